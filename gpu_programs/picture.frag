@@ -3,9 +3,34 @@
 in vec2 t_pos;
 out vec3 color;
 
-uniform sampler2D texture_sampler;
+// Escape iterations of the frame, -1 where unresolved
+uniform isampler2D iteration_sampler;
+uniform sampler1D palette_sampler;
+uniform int max_iter;
+// Palette position of iteration 0, moves when cycling colors
+uniform float palette_offset;
+
+vec3 iteration_color(ivec2 pos)
+{
+    pos = clamp(pos, ivec2(0,0), textureSize(iteration_sampler, 0) - 1);
+    int iter = texelFetch(iteration_sampler, pos, 0).r;
+    if(iter < 0)
+    {
+	return vec3(0,0,0);
+    }
+    return texture(palette_sampler, fract(float(iter) / float(max_iter) + palette_offset)).rgb;
+}
 
 void main()
 {
-    color = texture(texture_sampler, t_pos).rgb;
+    // Iterations can't be filtered, so blend the colors of the four
+    // nearest texels the way linear filtering would
+    vec2 pos = t_pos * vec2(textureSize(iteration_sampler, 0)) - 0.5;
+    vec2 base = floor(pos);
+    vec2 f = pos - base;
+    ivec2 p = ivec2(base);
+
+    vec3 bottom = mix(iteration_color(p), iteration_color(p + ivec2(1,0)), f.x);
+    vec3 top = mix(iteration_color(p + ivec2(0,1)), iteration_color(p + ivec2(1,1)), f.x);
+    color = mix(bottom, top, f.y);
 }
@@ -1,7 +1,8 @@
 #version 330 core
 
 in vec2 m_pos;
-out vec3 color;
+// Escape iteration, -1 if it doesn't escape. picture.frag colors it.
+out int iteration;
 
 vec2 c_sqr(in vec2 z)
 {
@@ -16,9 +17,9 @@ void main()
 	z = c_sqr(z) + m_pos;
 	if((z.x*z.x + z.y*z.y) > 4)
 	{
-	    color = (float(i) / 100.0) * vec3(1,1,1);
+	    iteration = i;
 	    return;
 	}
     }
-    color = vec3(0,0,0);
+    iteration = -1;
 }
@@ -1,25 +1,125 @@
-__kernel void test_kernel(float2 origin, float2 dx, float2 dy, image2d_t img)
+// Specialized per variant with -D options, see kernel_variant_options. The
+// defaults are the original kernel's. max_iter is an argument instead, so
+// changing it never needs a build.
+#ifndef BAILOUT
+#define BAILOUT 2
+#endif
+#define FORMULA_MANDELBROT 0
+#define FORMULA_TRICORN 1
+#ifndef FORMULA
+#define FORMULA FORMULA_MANDELBROT
+#endif
+#ifndef CARDIOID_CHECK
+#define CARDIOID_CHECK 0
+#endif
+
+#if USE_DOUBLE
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double real;
+typedef double2 real2;
+#else
+typedef float real;
+typedef float2 real2;
+#endif
+
+// Points in the main cardioid and the period 2 bulb never escape
+bool in_main_bulbs(real2 c)
+{
+#if CARDIOID_CHECK
+    real q = (c.x - 0.25f)*(c.x - 0.25f) + c.y*c.y;
+    return q*(q + (c.x - 0.25f)) <= 0.25f*c.y*c.y || (c.x + 1)*(c.x + 1) + c.y*c.y <= 0.0625f;
+#else
+    return false;
+#endif
+}
+
+// Iterates z from iteration start until end, returns the iteration it
+// escaped in or -1
+int iterate(real2 c, real2 *z_inout, int start, int end)
+{
+    const real bailout = BAILOUT;
+    real2 z = *z_inout;
+    int result = -1;
+    for(int i = start; i < end; ++i)
+    {
+#if FORMULA == FORMULA_TRICORN
+	z = (real2) ((z.x+z.y)*(z.x-z.y), -2*z.x*z.y);
+#else
+	z = (real2) ((z.x+z.y)*(z.x-z.y), 2*z.x*z.y);
+#endif
+	z = z + c;
+	if(dot(z,z) > bailout*bailout)
+	{
+	    result = i;
+	    break;
+	}
+    }
+    *z_inout = z;
+    return result;
+}
+
+// Writes the escape iteration of each pixel, or -1 if it doesn't escape
+// within max_iter, into rows of pitch ints from base on. Coloring is a
+// separate pass. Work sizes are rounded up to whole work-groups, the items
+// from pitch or end_row on have no pixel.
+__kernel void test_kernel(real2 origin, real2 dx, real2 dy, __global int *iterations, int pitch, int base, int end_row,
+			  int max_iter)
 {
     int x = get_global_id(0);
     int y = get_global_id(1);
-    int2 pos = (int2)(x,y);
-    
-    float2 c = origin + ((float)x)*dx + ((float)y)*dy;
+    if(x >= pitch || y >= end_row)
+    {
+	return;
+    }
 
-    float2 z = (float2)(0,0);
+    real2 c = origin + ((real)x)*dx + ((real)y)*dy;
+    real2 z = (real2)(0,0);
+    iterations[base + y*pitch + x] = in_main_bulbs(c) ? -1 : iterate(c, &z, 0, max_iter);
+}
+
+// Marks pixels still iterating between the chunks of chunk_kernel
+#define ITERATING -2
 
-    for(int i = 0; i < 100; ++i)
+// The same in chunks of the iterations from chunk_start until chunk_end,
+// so no launch runs long. Pixels still iterating keep z in state, at the
+// same index as their iterations, and count themselves in active.
+// The last chunk leaves -1 where they didn't escape.
+__kernel void chunk_kernel(real2 origin, real2 dx, real2 dy, __global int *iterations, int pitch, int base, int end_row,
+			   int max_iter, __global real2 *state, int chunk_start, int chunk_end, __global int *active)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if(x >= pitch || y >= end_row)
     {
-	z = (float2) ((z.x+z.y)*(z.x-z.y), 2*z.x*z.y);
-	z = z + c;
-	if(dot(z,z) > 4)
+	return;
+    }
+
+    int index = base + y*pitch + x;
+    real2 c = origin + ((real)x)*dx + ((real)y)*dy;
+    real2 z = (real2)(0,0);
+    if(chunk_start == 0)
+    {
+	if(in_main_bulbs(c))
 	{
-	    float x = (float)i / (float)100;
-	    float4 color = (float4)(x,x,x,1.0);
-	    write_imagef(img, pos, color);
+	    iterations[index] = -1;
 	    return;
 	}
     }
+    else if(iterations[index] != ITERATING)
+    {
+	return;
+    }
+    else
+    {
+	z = state[index];
+    }
 
-    write_imagef(img, pos, (float4)(0,0,0,1));
+    int result = iterate(c, &z, chunk_start, chunk_end);
+    if(result < 0 && chunk_end < max_iter)
+    {
+	state[index] = z;
+	result = ITERATING;
+	atomic_inc(active);
+    }
+    iterations[index] = result;
 }
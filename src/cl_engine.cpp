@@ -0,0 +1,1356 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#ifdef __APPLE__
+#include <OpenCL/cl_gl.h>
+#else
+#include <CL/cl_gl.h>
+#endif
+
+#include "cl_engine.h"
+#include "defer.h"
+#include "load_kernel.h"
+#include "mirror.h"
+
+std::string kernel_variant_options(const KernelVariant &variant)
+{
+    // BAILOUT is cast in the kernel, so the literal's type doesn't drag
+    // float variants into double math
+    char options[1024];
+    snprintf(options, sizeof(options), "-DBAILOUT=(real)%.17g -DFORMULA=%d -DUSE_DOUBLE=%d -DCARDIOID_CHECK=%d%s%s",
+	     variant.bailout, variant.formula, variant.precision == KERNEL_DOUBLE ? 1 : 0,
+	     variant.cardioid_check && variant.formula == FORMULA_MANDELBROT ? 1 : 0,
+	     variant.extra_options ? " " : "", variant.extra_options ? variant.extra_options : "");
+    return options;
+}
+
+// The device's buffer in slot, 0 or 1
+static cl_mem slot_buffer(const ClEngine *engine, int device, int slot)
+{
+    return engine->iterations[2*device + slot];
+}
+
+static void copy_out(std::vector<ClStagedCopy> *copies)
+{
+    for(const ClStagedCopy &copy : *copies)
+    {
+	memcpy(copy.to, copy.from, copy.bytes);
+    }
+    copies->clear();
+}
+
+// Waits for the reads still writing to the caller's memory, then lets go
+// of events
+static void release_events(std::vector<cl_event> *reads, std::vector<cl_event> *kernels)
+{
+    for(cl_event &event : *reads)
+    {
+	if(event)
+	{
+	    clWaitForEvents(1, &event);
+	    clReleaseEvent(event);
+	    event = nullptr;
+	}
+    }
+    for(cl_event &event : *kernels)
+    {
+	if(event)
+	{
+	    clReleaseEvent(event);
+	    event = nullptr;
+	}
+    }
+}
+
+static void variant_release(ClKernelVariant *variant)
+{
+    if(variant->build)
+    {
+	// The driver's callback still points at the build
+	cl_kernel unused = nullptr;
+	if(kernel_build_finish(variant->build, "test_kernel", unused))
+	{
+	    clReleaseKernel(unused);
+	}
+    }
+    if(variant->kernel)
+    {
+	clReleaseKernel(variant->kernel);
+    }
+    if(variant->chunk_kernel)
+    {
+	clReleaseKernel(variant->chunk_kernel);
+    }
+    free(variant->local_sizes);
+    memset(variant, 0, sizeof(*variant));
+}
+
+// Arguments of one of variant's kernels for a region with its top left
+// pixel at (origin_x, origin_y), written base ints into the buffer
+static void set_region_args(const ClKernelVariant &variant, cl_kernel kernel, double origin_x, double origin_y, double step, int width, size_t base)
+{
+    if(variant.precision == KERNEL_DOUBLE)
+    {
+	cl_double2 origin = {origin_x, origin_y};
+	cl_double2 dx = {step, 0};
+	cl_double2 dy = {0, step};
+	clSetKernelArg(kernel, 0, sizeof(cl_double2), &origin);
+	clSetKernelArg(kernel, 1, sizeof(cl_double2), &dx);
+	clSetKernelArg(kernel, 2, sizeof(cl_double2), &dy);
+    }
+    else
+    {
+	cl_float2 origin = {(float)origin_x, (float)origin_y};
+	cl_float2 dx = {(float)step, 0};
+	cl_float2 dy = {0, (float)step};
+	clSetKernelArg(kernel, 0, sizeof(cl_float2), &origin);
+	clSetKernelArg(kernel, 1, sizeof(cl_float2), &dx);
+	clSetKernelArg(kernel, 2, sizeof(cl_float2), &dy);
+    }
+    cl_int pitch = width;
+    cl_int base_arg = (cl_int)base;
+    clSetKernelArg(kernel, 4, sizeof(cl_int), &pitch);
+    clSetKernelArg(kernel, 5, sizeof(cl_int), &base_arg);
+}
+
+// Launches one of variant's kernels over rows of width pixels from
+// first_row on, writing into buffer once wait_for is done, in the device's
+// tuned work-groups and up to the variant's max_iter. The work sizes are
+// rounded up to whole work-groups and the kernel skips the rest.
+static cl_int enqueue_rows(ClEngine *engine, const ClKernelVariant &variant, cl_kernel kernel, int device, cl_mem buffer,
+			   int first_row, int width, int rows, cl_uint n_wait, const cl_event *wait_for, cl_event *done)
+{
+    cl_int end_row = first_row + rows;
+    cl_int max_iter = variant.max_iter;
+    clSetKernelArg(kernel, 3, sizeof(cl_mem), (void*)&buffer);
+    clSetKernelArg(kernel, 6, sizeof(cl_int), &end_row);
+    clSetKernelArg(kernel, 7, sizeof(cl_int), &max_iter);
+    
+    const size_t *local_sizes = variant.local_sizes ? &variant.local_sizes[2*device] : nullptr;
+    if(local_sizes && local_sizes[0] == 0)
+    {
+	local_sizes = nullptr;
+    }
+    const size_t work_offset[] = {0, (size_t)first_row};
+    size_t work_sizes[] = {(size_t)width, (size_t)rows};
+    if(local_sizes)
+    {
+	for(int i = 0; i < 2; ++i)
+	{
+	    work_sizes[i] = (work_sizes[i] + local_sizes[i] - 1) / local_sizes[i] * local_sizes[i];
+	}
+    }
+    return clEnqueueNDRangeKernel(engine->command_queues[device], kernel, 2, work_offset, work_sizes, local_sizes,
+				  n_wait, wait_for, done);
+}
+
+// Tuning renders the whole set into a square of pixels
+#define CL_TUNE_SIZE 512
+#define CL_TUNE_RUNS 3
+
+// Device milliseconds of a launch over the tuning region in local_x by
+// local_y work-groups, the best of a few. Negative if it doesn't launch.
+static double time_launch(ClEngine *engine, ClKernelVariant *variant, int device, size_t local_x, size_t local_y)
+{
+    variant->local_sizes[2*device] = local_x;
+    variant->local_sizes[2*device + 1] = local_y;
+    double best = -1;
+    for(int run = 0; run < CL_TUNE_RUNS; ++run)
+    {
+	cl_event done = nullptr;
+	if(enqueue_rows(engine, *variant, variant->kernel, device, engine->tuning_scratch, 0, CL_TUNE_SIZE, CL_TUNE_SIZE, 0, nullptr, &done) != CL_SUCCESS)
+	{
+	    return -1;
+	}
+	defer { clReleaseEvent(done); };
+	
+	cl_ulong start = 0;
+	cl_ulong end = 0;
+	if(clWaitForEvents(1, &done) != CL_SUCCESS ||
+	   clGetEventProfilingInfo(done, CL_PROFILING_COMMAND_START, sizeof(start), &start, nullptr) != CL_SUCCESS ||
+	   clGetEventProfilingInfo(done, CL_PROFILING_COMMAND_END, sizeof(end), &end, nullptr) != CL_SUCCESS)
+	{
+	    return -1;
+	}
+	double ms = (double)(end - start) * 1e-6;
+	if(best < 0 || ms < best)
+	{
+	    best = ms;
+	}
+    }
+    return best;
+}
+
+// Times the driver's choice and every power of two shape the kernel allows
+// on each device whose size is a multiple of the preferred one, and adds
+// the fastest to results. Runs on the tuning thread, with a variant only
+// it uses.
+static void variant_tune(ClEngine *engine, ClKernelVariant *variant, std::vector<ClTunedSize> *results)
+{
+    // Renders may be using the iterations buffers
+    set_region_args(*variant, variant->kernel, -2.0, -1.5, 3.0 / CL_TUNE_SIZE, CL_TUNE_SIZE, 0);
+
+    for(cl_uint i = 0; i < engine->n_devices; ++i)
+    {
+	cl_device_id device = engine->devices[i];
+	size_t max_size = 0;
+	size_t multiple = 1;
+	size_t item_sizes[3] = {0, 0, 0};
+	clGetKernelWorkGroupInfo(variant->kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_size), &max_size, nullptr);
+	clGetKernelWorkGroupInfo(variant->kernel, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(multiple), &multiple, nullptr);
+	clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(item_sizes), item_sizes, nullptr);
+	if(multiple == 0)
+	{
+	    multiple = 1;
+	}
+
+	double driver_ms = time_launch(engine, variant, i, 0, 0);
+	ClTunedSize best = {cl_tuning_key(device, variant->options), 0, 0, driver_ms, "", true};
+	for(size_t x = 1; x <= max_size && x <= item_sizes[0]; x *= 2)
+	{
+	    for(size_t y = 1; x*y <= max_size && y <= item_sizes[1]; y *= 2)
+	    {
+		if((x*y) % multiple != 0)
+		{
+		    continue;
+		}
+		double ms = time_launch(engine, variant, i, x, y);
+		if(ms >= 0 && (best.ms < 0 || ms < best.ms))
+		{
+		    best.local_x = (int)x;
+		    best.local_y = (int)y;
+		    best.ms = ms;
+		}
+	    }
+	}
+	variant->local_sizes[2*i] = best.local_x;
+	variant->local_sizes[2*i + 1] = best.local_y;
+	
+	char name[256] = "";
+	clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, nullptr);
+	if(best.ms < 0)
+	{
+	    fprintf(stderr, "Unable to time kernels on %s\n", name);
+	    continue;
+	}
+	best.label = std::string(name) + ": " + variant->options;
+	printf("Tuned %s: %ix%i work-groups in %.3f ms, the driver's choice in %.3f ms\n",
+	       best.label.c_str(), best.local_x, best.local_y, best.ms, driver_ms);
+	results->push_back(best);
+    }
+}
+
+static void tune_main(ClEngine *engine, ClTuneJob *job)
+{
+    variant_tune(engine, &job->variant, &job->results);
+    job->done = true;
+}
+
+// Starts sweeping variant's shapes with a kernel of its own
+static void tune_start(ClEngine *engine, ClKernelVariant *variant)
+{
+    variant->tune_pending = false;
+    cl_int ret;
+    if(!engine->tuning_scratch)
+    {
+	engine->tuning_scratch = clCreateBuffer(engine->context, CL_MEM_WRITE_ONLY, (size_t)CL_TUNE_SIZE*CL_TUNE_SIZE*sizeof(s32),
+						nullptr, &ret);
+	if(ret != CL_SUCCESS)
+	{
+	    fprintf(stderr, "Unable to create OpenCL tuning buffer\n");
+	    engine->tuning_scratch = nullptr;
+	    return;
+	}
+    }
+
+    cl_program program = nullptr;
+    cl_kernel kernel = nullptr;
+    ret = clGetKernelInfo(variant->kernel, CL_KERNEL_PROGRAM, sizeof(program), &program, nullptr);
+    if(ret == CL_SUCCESS)
+    {
+	kernel = clCreateKernel(program, "test_kernel", &ret);
+    }
+    if(ret != CL_SUCCESS)
+    {
+	fprintf(stderr, "Unable to create a kernel for tuning\n");
+	return;
+    }
+
+    ClTuneJob *job = new ClTuneJob;
+    memset(&job->variant, 0, sizeof(job->variant));
+    strcpy(job->variant.options, variant->options);
+    job->variant.precision = variant->precision;
+    job->variant.max_iter = variant->max_iter;
+    job->variant.kernel = kernel;
+    job->variant.local_sizes = (size_t*) calloc(2 * engine->n_devices, sizeof(size_t));
+    job->done = false;
+    job->thread = std::thread(tune_main, engine, job);
+    engine->tune_job = job;
+}
+
+static void tune_release(ClTuneJob *job)
+{
+    job->thread.join();
+    variant_release(&job->variant);
+    delete job;
+}
+
+// Takes in a finished sweep, then starts the next variant waiting for one
+static void tune_update(ClEngine *engine)
+{
+    ClTuneJob *job = engine->tune_job;
+    if(job && job->done)
+    {
+	engine->tune_job = nullptr;
+	for(const ClTunedSize &size : job->results)
+	{
+	    cl_tuning_store(engine->tuning, size);
+	}
+	if(!job->results.empty())
+	{
+	    cl_tuning_save(engine->tuning, CL_TUNING_FILENAME);
+	}
+
+	// Unless the variant was dropped meanwhile
+	for(int i = 0; i < engine->n_variants; ++i)
+	{
+	    ClKernelVariant *variant = &engine->variants[i];
+	    if(variant->local_sizes && strcmp(variant->options, job->variant.options) == 0)
+	    {
+		memcpy(variant->local_sizes, job->variant.local_sizes, 2 * engine->n_devices * sizeof(size_t));
+	    }
+	}
+	tune_release(job);
+    }
+
+    for(int i = 0; i < engine->n_variants && !engine->tune_job; ++i)
+    {
+	if(engine->variants[i].tune_pending)
+	{
+	    tune_start(engine, &engine->variants[i]);
+	}
+    }
+}
+
+// A failed variant keeps its slot with neither a build nor a kernel, so
+// selecting it again doesn't rebuild it
+static void variant_finish(ClEngine *engine, ClKernelVariant *variant)
+{
+    KernelBuild *build = variant->build;
+    variant->build = nullptr;
+    if(!kernel_build_finish(build, "test_kernel", variant->kernel))
+    {
+	variant->kernel = nullptr;
+	return;
+    }
+
+    // The kernel keeps its program alive, the chunked one comes from there
+    cl_program program = nullptr;
+    cl_int ret = clGetKernelInfo(variant->kernel, CL_KERNEL_PROGRAM, sizeof(program), &program, nullptr);
+    if(ret == CL_SUCCESS)
+    {
+	variant->chunk_kernel = clCreateKernel(program, "chunk_kernel", &ret);
+    }
+    if(ret != CL_SUCCESS)
+    {
+	fprintf(stderr, "Unable to create chunk_kernel\n");
+	clReleaseKernel(variant->kernel);
+	variant->kernel = nullptr;
+	variant->chunk_kernel = nullptr;
+	return;
+    }
+
+    // The stored shapes, or the driver's choice. Tuning measures them again
+    // once per run, in the background.
+    variant->local_sizes = (size_t*) calloc(2 * engine->n_devices, sizeof(size_t));
+    bool measured = true;
+    for(cl_uint i = 0; i < engine->n_devices; ++i)
+    {
+	const ClTunedSize *tuned = cl_tuning_find(engine->tuning, cl_tuning_key(engine->devices[i], variant->options));
+	if(tuned)
+	{
+	    variant->local_sizes[2*i] = tuned->local_x;
+	    variant->local_sizes[2*i + 1] = tuned->local_y;
+	}
+	measured = measured && tuned && tuned->measured;
+    }
+    variant->tune_pending = engine->tune && !measured;
+}
+
+static ClEngineState variant_state(const ClEngine *engine)
+{
+    if(engine->current < 0)
+    {
+	return CL_ENGINE_FAILED;
+    }
+    const ClKernelVariant &variant = engine->variants[engine->current];
+    return variant.kernel ? CL_ENGINE_READY : variant.build ? CL_ENGINE_BUILDING : CL_ENGINE_FAILED;
+}
+
+// A free slot, or the least recently used one that isn't selected
+static int variant_slot(ClEngine *engine)
+{
+    if(engine->n_variants < CL_ENGINE_MAX_VARIANTS)
+    {
+	return engine->n_variants++;
+    }
+    int oldest = -1;
+    for(int i = 0; i < engine->n_variants; ++i)
+    {
+	if(i != engine->current && (oldest < 0 || engine->variants[i].last_used < engine->variants[oldest].last_used))
+	{
+	    oldest = i;
+	}
+    }
+    variant_release(&engine->variants[oldest]);
+    return oldest;
+}
+
+// Pinned host memory the size of each iterations buffer, mapped once
+static bool staging_buffers(ClEngine *engine)
+{
+    size_t image_bytes = (size_t)IMAGE_SIZE*IMAGE_SIZE*sizeof(s32);
+    for(cl_uint i = 0; i < 2 * engine->n_devices; ++i)
+    {
+	cl_int ret;
+	engine->staging[i] = clCreateBuffer(engine->context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, image_bytes, nullptr, &ret);
+	if(ret != CL_SUCCESS)
+	{
+	    fprintf(stderr, "Unable to create OpenCL staging buffer\n");
+	    engine->staging[i] = nullptr;
+	    return false;
+	}
+	engine->staging_host[i] = (s32*)clEnqueueMapBuffer(engine->command_queues[i / 2], engine->staging[i], CL_TRUE,
+							    CL_MAP_READ | CL_MAP_WRITE, 0, image_bytes, 0, nullptr, nullptr, &ret);
+	if(ret != CL_SUCCESS)
+	{
+	    fprintf(stderr, "Unable to map OpenCL staging buffer\n");
+	    engine->staging_host[i] = nullptr;
+	    return false;
+	}
+    }
+    return true;
+}
+
+static bool devices_have_extension(const cl_device_id *devices, cl_uint n_devices, const char *extension)
+{
+    for(cl_uint i = 0; i < n_devices; ++i)
+    {
+	size_t size = 0;
+	clGetDeviceInfo(devices[i], CL_DEVICE_EXTENSIONS, 0, nullptr, &size);
+	std::string extensions(size, '\0');
+	clGetDeviceInfo(devices[i], CL_DEVICE_EXTENSIONS, size, &extensions[0], nullptr);
+	// Space separated, so match whole names
+	extensions = " " + std::string(extensions.c_str()) + " ";
+	if(extensions.find(std::string(" ") + extension + " ") == std::string::npos)
+	{
+	    return false;
+	}
+    }
+    return true;
+}
+
+// The device running the GL context in properties, 0 if the driver can't
+// say
+static cl_uint gl_device(cl_platform_id platform, const cl_context_properties *properties, const cl_device_id *devices, cl_uint n_devices)
+{
+    clGetGLContextInfoKHR_fn get_info = (clGetGLContextInfoKHR_fn)clGetExtensionFunctionAddressForPlatform(platform, "clGetGLContextInfoKHR");
+    cl_device_id device = nullptr;
+    if(!get_info || get_info(properties, CL_CURRENT_DEVICE_FOR_GL_CONTEXT_KHR, sizeof(device), &device, nullptr) != CL_SUCCESS)
+    {
+	return 0;
+    }
+    for(cl_uint i = 0; i < n_devices; ++i)
+    {
+	if(devices[i] == device)
+	{
+	    return i;
+	}
+    }
+    return 0;
+}
+
+bool cl_engine_init(ClEngine *engine, void (*on_built)(), int flags, const cl_context_properties *gl_share)
+{
+    bool profile = flags & CL_ENGINE_PROFILE;
+    bool tune = flags & CL_ENGINE_TUNE;
+    memset(engine, 0, sizeof(*engine));
+    engine->current = -1;
+    engine->on_built = on_built;
+    auto cleanup = deferred { cl_engine_release(engine); };
+    
+    // Get OpenCL platforms
+    cl_uint n_platforms = 0;
+    cl_int ret = clGetPlatformIDs(0, nullptr, &n_platforms);
+
+    if(n_platforms == 0)
+    {
+	fprintf(stderr, "No OpenCL platforms!\n");
+	return false;
+    }
+
+    // Use the first platform for now
+    cl_platform_id platform;
+
+    clGetPlatformIDs(1, &platform, nullptr);
+
+    // Get GPU device ids
+    //
+    cl_uint n_gpus = 0;
+    ret = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 0, nullptr, &n_gpus);
+    if(ret == CL_DEVICE_NOT_FOUND)
+    {
+	fprintf(stderr, "No GPU's on the first OpenCL platform\n");
+	return false;
+    }
+
+    engine->devices = (cl_device_id*) malloc(sizeof(cl_device_id) * n_gpus);
+
+    clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, n_gpus, engine->devices, nullptr);
+
+    // Create OpenCL context, sharing with the GL one when asked and every
+    // device can. Drivers refuse to when a device doesn't drive the GL
+    // context, then it's a plain context.
+    if(gl_share && devices_have_extension(engine->devices, n_gpus, "cl_khr_gl_sharing"))
+    {
+	std::vector<cl_context_properties> properties = {CL_CONTEXT_PLATFORM, (cl_context_properties)platform};
+	for(const cl_context_properties *property = gl_share; *property; property += 2)
+	{
+	    properties.push_back(property[0]);
+	    properties.push_back(property[1]);
+	}
+	properties.push_back(0);
+	engine->context = clCreateContext(properties.data(), n_gpus, engine->devices, nullptr, nullptr, &ret);
+	engine->gl_sharing = ret == CL_SUCCESS;
+	if(engine->gl_sharing)
+	{
+	    engine->gl_device = gl_device(platform, properties.data(), engine->devices, n_gpus);
+	}
+	else
+	{
+	    printf("OpenCL can't share the GL context, error code %i\n", ret);
+	}
+    }
+    if(!engine->gl_sharing)
+    {
+	engine->context = clCreateContext(nullptr, n_gpus, engine->devices, nullptr, nullptr, &ret);
+    }
+    if(ret == CL_DEVICE_NOT_AVAILABLE)
+    {
+	fprintf(stderr, "GPU's are not available\n");
+	return false;
+    }
+    else if(ret == CL_OUT_OF_HOST_MEMORY)
+    {
+	fprintf(stderr, "OpenCL didn't have enough memory\n");
+	return false;
+    }
+    else if(ret != CL_SUCCESS)
+    {
+	fprintf(stderr, "Unable to create context. Error code %i\n", ret);
+	return false;
+    }
+
+    // Create OpenCL command queues
+    //
+    engine->command_queues = (cl_command_queue*) calloc(n_gpus, sizeof(cl_command_queue));
+    engine->iterations = (cl_mem*) calloc(2 * n_gpus, sizeof(cl_mem));
+    engine->chunk_state = (cl_mem*) calloc(n_gpus, sizeof(cl_mem));
+    engine->chunk_active = (cl_mem*) calloc(n_gpus, sizeof(cl_mem));
+    engine->staging = (cl_mem*) calloc(2 * n_gpus, sizeof(cl_mem));
+    engine->staging_host = (s32**) calloc(2 * n_gpus, sizeof(s32*));
+
+    for(cl_uint i = 0; i < n_gpus; ++i)
+    {
+	// Kernel timings balance several devices and pick work-group shapes
+	cl_command_queue_properties timing = profile || tune || n_gpus > 1 ? CL_QUEUE_PROFILING_ENABLE : 0;
+	cl_command_queue queue = clCreateCommandQueue(engine->context, engine->devices[i],
+						      CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE | timing, &ret);
+	
+	if(ret == CL_INVALID_QUEUE_PROPERTIES)
+	{
+	    queue = clCreateCommandQueue(engine->context, engine->devices[i], timing, &ret);
+	}
+	if(ret == CL_OUT_OF_HOST_MEMORY)
+	{
+	    fprintf(stderr, "OpenCL ran out of memory\n");
+	}
+	else if(ret != CL_SUCCESS)
+	{
+	    fprintf(stderr, "Unable to create command queues. Error code %i\n", ret);
+	}
+	if(ret != CL_SUCCESS)
+	{
+	    return false;
+	}
+	engine->command_queues[i] = queue;
+	engine->n_devices = i+1;
+    }
+
+    engine->batch_kernels = new std::vector<cl_event>[2 * n_gpus];
+    engine->batch_reads = new std::vector<cl_event>[2 * n_gpus];
+    engine->batch_copies = new std::vector<ClStagedCopy>[2 * n_gpus];
+    if(profile)
+    {
+	engine->profile = new ClProfile;
+	cl_profile_init(engine->profile, n_gpus);
+    }
+    engine->tuning = new ClTuning;
+    engine->tune = tune;
+    cl_tuning_load(engine->tuning, CL_TUNING_FILENAME);
+
+    // Until there are timings, guess the rates from the hardware
+    engine->pixel_rates = (double*) malloc(sizeof(double) * n_gpus);
+    for(cl_uint i = 0; i < n_gpus; ++i)
+    {
+	cl_uint compute_units = 1;
+	cl_uint clock_mhz = 1;
+	clGetDeviceInfo(engine->devices[i], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, nullptr);
+	clGetDeviceInfo(engine->devices[i], CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(clock_mhz), &clock_mhz, nullptr);
+	engine->pixel_rates[i] = (double)(compute_units > 0 ? compute_units : 1) * (clock_mhz > 0 ? clock_mhz : 1);
+    }
+
+    // Double variants need every device to do doubles
+    engine->has_double = true;
+    for(cl_uint i = 0; i < n_gpus; ++i)
+    {
+	cl_device_fp_config fp64 = 0;
+	clGetDeviceInfo(engine->devices[i], CL_DEVICE_DOUBLE_FP_CONFIG, sizeof(fp64), &fp64, nullptr);
+	engine->has_double = engine->has_double && fp64 != 0;
+    }
+
+    engine->unified = true;
+    for(cl_uint i = 0; i < n_gpus; ++i)
+    {
+	cl_bool unified = CL_FALSE;
+	clGetDeviceInfo(engine->devices[i], CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified), &unified, nullptr);
+	engine->unified = engine->unified && unified;
+    }
+
+    // Every variant writes to the device's own buffers and reads go through
+    // the same staging, so rendering never allocates
+    size_t image_bytes = (size_t)IMAGE_SIZE*IMAGE_SIZE*sizeof(s32);
+    cl_mem_flags mem_flags = CL_MEM_WRITE_ONLY | (engine->unified ? CL_MEM_ALLOC_HOST_PTR : 0);
+    for(cl_uint i = 0; i < 2 * n_gpus; ++i)
+    {
+	engine->iterations[i] = clCreateBuffer(engine->context, mem_flags, image_bytes, nullptr, &ret);
+	if(ret != CL_SUCCESS)
+	{
+	    fprintf(stderr, "Unable to create OpenCL buffer\n");
+	    engine->iterations[i] = nullptr;
+	    return false;
+	}
+    }
+    if(!engine->unified && !staging_buffers(engine))
+    {
+	return false;
+    }
+
+    cleanup.deactivate();
+    return true;
+}
+
+ClEngineState cl_engine_update(ClEngine *engine)
+{
+    for(int i = 0; i < engine->n_variants; ++i)
+    {
+	ClKernelVariant *variant = &engine->variants[i];
+	if(variant->build && kernel_build_done(variant->build))
+	{
+	    variant_finish(engine, variant);
+	}
+    }
+    if(engine->tune)
+    {
+	tune_update(engine);
+    }
+    return variant_state(engine);
+}
+
+ClEngineState cl_engine_wait(ClEngine *engine)
+{
+    if(engine->current >= 0 && engine->variants[engine->current].build)
+    {
+	variant_finish(engine, &engine->variants[engine->current]);
+    }
+    return variant_state(engine);
+}
+
+ClEngineState cl_engine_select(ClEngine *engine, const KernelVariant &variant)
+{
+    std::string options = kernel_variant_options(variant);
+    if(options.size() >= CL_ENGINE_MAX_OPTIONS)
+    {
+	fprintf(stderr, "Kernel build options too long: %s\n", options.c_str());
+	return CL_ENGINE_FAILED;
+    }
+    if(variant.precision == KERNEL_DOUBLE && !engine->has_double)
+    {
+	fprintf(stderr, "Not every OpenCL device does double precision\n");
+	return CL_ENGINE_FAILED;
+    }
+
+    int index = -1;
+    for(int i = 0; i < engine->n_variants; ++i)
+    {
+	if(strcmp(engine->variants[i].options, options.c_str()) == 0)
+	{
+	    index = i;
+	    break;
+	}
+    }
+    if(index < 0)
+    {
+	index = variant_slot(engine);
+	ClKernelVariant *slot = &engine->variants[index];
+	strcpy(slot->options, options.c_str());
+	slot->precision = variant.precision;
+	slot->max_iter = variant.max_iter;
+	slot->build = kernel_build_start(engine->context, engine->n_devices, engine->devices, "gpu_programs/test.cl",
+					 slot->options, engine->on_built);
+    }
+
+    // Not part of the program, the next launches pass it on
+    engine->variants[index].max_iter = variant.max_iter;
+    engine->current = index;
+    engine->variants[index].last_used = ++engine->use_count;
+    return cl_engine_update(engine);
+}
+
+void cl_engine_release(ClEngine *engine)
+{
+    if(engine->tune_job)
+    {
+	tune_release(engine->tune_job);
+    }
+    for(int i = 0; i < engine->n_variants; ++i)
+    {
+	variant_release(&engine->variants[i]);
+    }
+    if(engine->batch_kernels)
+    {
+	for(cl_uint i = 0; i < 2 * engine->n_devices; ++i)
+	{
+	    release_events(&engine->batch_reads[i], &engine->batch_kernels[i]);
+	}
+	delete[] engine->batch_kernels;
+	delete[] engine->batch_reads;
+	delete[] engine->batch_copies;
+    }
+    if(engine->tuning_scratch)
+    {
+	clReleaseMemObject(engine->tuning_scratch);
+    }
+    for(cl_uint i = 0; i < 2 * engine->n_devices; ++i)
+    {
+	if(engine->staging_host[i])
+	{
+	    clEnqueueUnmapMemObject(engine->command_queues[i / 2], engine->staging[i], engine->staging_host[i], 0, nullptr, nullptr);
+	    clFinish(engine->command_queues[i / 2]);
+	}
+	if(engine->staging[i])
+	{
+	    clReleaseMemObject(engine->staging[i]);
+	}
+    }
+    for(cl_uint i = 0; i < engine->n_devices; ++i)
+    {
+	cl_mem buffers[] = {engine->iterations[2*i], engine->iterations[2*i + 1], engine->chunk_state[i], engine->chunk_active[i]};
+	for(cl_mem buffer : buffers)
+	{
+	    if(buffer)
+	    {
+		clReleaseMemObject(buffer);
+	    }
+	}
+	clReleaseCommandQueue(engine->command_queues[i]);
+    }
+    free(engine->iterations);
+    free(engine->staging);
+    free(engine->staging_host);
+    free(engine->chunk_state);
+    free(engine->chunk_active);
+    free(engine->command_queues);
+    if(engine->context)
+    {
+	clReleaseContext(engine->context);
+    }
+    delete engine->profile;
+    delete engine->tuning;
+    free(engine->devices);
+    free(engine->pixel_rates);
+    memset(engine, 0, sizeof(*engine));
+}
+
+// Starts reading bytes at offset of the device's buffer in slot once
+// wait_for is done. On unified memory it goes straight into out, which has
+// to stay until done is. Otherwise it goes to the same offset of the slot's
+// staging, and copies gets what to copy into out once done is.
+static bool enqueue_read(ClEngine *engine, int device, int slot, cl_event wait_for, size_t offset, size_t bytes, void *out,
+			 std::vector<ClStagedCopy> *copies, cl_event *done)
+{
+    void *to = out;
+    s32 *staging = engine->staging_host ? engine->staging_host[2*device + slot] : nullptr;
+    if(staging)
+    {
+	to = (u8*)staging + offset;
+    }
+    cl_int ret = clEnqueueReadBuffer(engine->command_queues[device], slot_buffer(engine, device, slot), CL_FALSE, offset, bytes, to,
+				     1, &wait_for, done);
+    if(ret != CL_SUCCESS)
+    {
+	*done = nullptr;
+	fprintf(stderr, "Unable to read buffer\n");
+	return false;
+    }
+    if(staging)
+    {
+	copies->push_back({to, out, bytes});
+    }
+    return true;
+}
+
+// A region enqueued on the devices and not finished yet
+struct ClPendingRegion
+{
+    RenderRegion region;
+    MirrorSplit split;
+    bool mirrored;
+    double origin_y;      // of the rows computed
+    size_t base;
+    std::vector<int> band_start;
+    s32 *iterations;      // where the reads go
+    std::vector<cl_event> kernels_done;
+    std::vector<cl_event> reads_done;
+    std::vector<ClStagedCopy> copies;
+};
+
+static void release_region(ClPendingRegion *pending)
+{
+    release_events(&pending->reads_done, &pending->kernels_done);
+    pending->copies.clear();
+}
+
+// Where region goes from base on, and the band of its rows each device
+// renders
+static void layout_region(ClEngine *engine, const RenderRegion &region, size_t base, ClPendingRegion *pending)
+{
+    pending->region = region;
+    pending->base = base;
+    
+    // Only render one side of the real axis if the view straddles it
+    pending->origin_y = region.origin_y;
+    MirrorSplit &split = pending->split;
+    pending->mirrored = mirror_split(&pending->origin_y, region.step, region.height, 0, &split);
+    if(!pending->mirrored)
+    {
+	split.compute_row = 0;
+	split.compute_rows = region.height;
+    }
+
+    // Split the rows in proportion to the pixel rates
+    int n_devices = engine->n_devices;
+    std::vector<int> &band_start = pending->band_start;
+    band_start.assign(n_devices + 1, 0);
+    double total_rate = 0;
+    for(int i = 0; i < n_devices; ++i)
+    {
+	total_rate += engine->pixel_rates[i];
+    }
+    double rate_sum = 0;
+    for(int i = 0; i < n_devices; ++i)
+    {
+	band_start[i] = (int)(split.compute_rows * rate_sum / total_rate + 0.5);
+	rate_sum += engine->pixel_rates[i];
+    }
+    band_start[n_devices] = split.compute_rows;
+}
+
+// Starts region's bands on every device in the buffers of slot, each read
+// back as soon as it's done. The region that used the slot before has to be
+// finished.
+static bool enqueue_region(ClEngine *engine, const RenderRegion &region, int slot, s32 *iterations, ClPendingRegion *pending)
+{
+    layout_region(engine, region, 0, pending);
+    pending->iterations = iterations;
+    const ClKernelVariant &variant = engine->variants[engine->current];
+    set_region_args(variant, variant.kernel, region.origin_x, pending->origin_y, region.step, region.width, 0);
+
+    // Start every band before waiting on any, so the devices overlap
+    const MirrorSplit &split = pending->split;
+    const std::vector<int> &band_start = pending->band_start;
+    int n_devices = engine->n_devices;
+    pending->kernels_done.assign(n_devices, nullptr);
+    pending->reads_done.assign(n_devices, nullptr);
+    pending->copies.clear();
+    for(int i = 0; i < n_devices; ++i)
+    {
+	int rows = band_start[i+1] - band_start[i];
+	if(rows == 0)
+	{
+	    continue;
+	}
+	cl_int ret = enqueue_rows(engine, variant, variant.kernel, i, slot_buffer(engine, i, slot), split.compute_row + band_start[i],
+				  region.width, rows, 0, nullptr, &pending->kernels_done[i]);
+	if(ret != CL_SUCCESS)
+	{
+	    pending->kernels_done[i] = nullptr;
+	    release_region(pending);
+	    fprintf(stderr, "Unable to enqueue task\n");
+	    return false;
+	}
+
+	// The queues may be out of order, so the read has to wait on the kernel
+	size_t read_offset = (size_t)(split.compute_row + band_start[i]) * region.width;
+	if(!enqueue_read(engine, i, slot, pending->kernels_done[i], read_offset * sizeof(s32), (size_t)rows * region.width * sizeof(s32),
+			 iterations + read_offset, &pending->copies, &pending->reads_done[i]))
+	{
+	    release_region(pending);
+	    return false;
+	}
+    }
+    return true;
+}
+
+// Waits for an enqueued region's reads, then times the devices and fills in
+// the mirrored rows
+static bool finish_region(ClEngine *engine, ClPendingRegion *pending)
+{
+    defer { release_region(pending); };
+    const RenderRegion &region = pending->region;
+    const std::vector<int> &band_start = pending->band_start;
+    int n_devices = engine->n_devices;
+    
+    std::vector<double> rates(n_devices, 0.0);
+    for(int i = 0; i < n_devices; ++i)
+    {
+	cl_event kernel_done = pending->kernels_done[i];
+	cl_event read_done = pending->reads_done[i];
+	if(!kernel_done)
+	{
+	    continue;
+	}
+	if(clWaitForEvents(1, &read_done) != CL_SUCCESS)
+	{
+	    fprintf(stderr, "Unable to read buffer\n");
+	    return false;
+	}
+	if(engine->profile)
+	{
+	    cl_profile_add(engine->profile, i, PROFILE_KERNEL, kernel_done);
+	    cl_profile_add(engine->profile, i, PROFILE_READ, read_done);
+	}
+
+	int rows = band_start[i+1] - band_start[i];
+	cl_ulong start = 0;
+	cl_ulong end = 0;
+	if(clGetEventProfilingInfo(kernel_done, CL_PROFILING_COMMAND_START, sizeof(start), &start, nullptr) == CL_SUCCESS &&
+	   clGetEventProfilingInfo(kernel_done, CL_PROFILING_COMMAND_END, sizeof(end), &end, nullptr) == CL_SUCCESS &&
+	   end > start)
+	{
+	    rates[i] = (double)rows * region.width / ((double)(end - start) * 1e-9);
+	}
+    }
+
+    // The guesses are in other units, so they go all at once when every
+    // device has a timing. After that each moves halfway to its latest
+    // rate, steady but quick to follow a device that slows down.
+    bool all_timed = true;
+    for(double rate : rates)
+    {
+	all_timed = all_timed && rate > 0;
+    }
+    if(all_timed || engine->rates_timed)
+    {
+	for(int i = 0; i < n_devices; ++i)
+	{
+	    if(rates[i] > 0)
+	    {
+		engine->pixel_rates[i] = engine->rates_timed ? 0.5 * engine->pixel_rates[i] + 0.5 * rates[i] : rates[i];
+	    }
+	}
+	engine->rates_timed = true;
+    }
+
+    copy_out(&pending->copies);
+    if(pending->mirrored)
+    {
+	mirror_rows(pending->split, pending->iterations, region.width * sizeof(s32));
+    }
+    
+    return true;
+}
+
+bool cl_engine_render(ClEngine *engine, const RenderRegion &region, s32 *iterations)
+{
+    ClPendingRegion pending;
+    return enqueue_region(engine, region, 0, iterations, &pending) && finish_region(engine, &pending);
+}
+
+bool cl_engine_render_tiles(ClEngine *engine, const RenderRegion *regions, int n, s32 *const *iterations)
+{
+    // The regions take turns in the two slots. The host finishes each
+    // region before the one two after it takes over its slot and staging,
+    // while the devices work on the one in between.
+    std::vector<ClPendingRegion> pending(n);
+    for(int i = 0; i < n && i < 2; ++i)
+    {
+	if(!enqueue_region(engine, regions[i], i, iterations[i], &pending[i]))
+	{
+	    for(int j = 0; j < i; ++j)
+	    {
+		release_region(&pending[j]);
+	    }
+	    return false;
+	}
+    }
+    for(int i = 0; i < n; ++i)
+    {
+	if(!finish_region(engine, &pending[i]) ||
+	   (i + 2 < n && !enqueue_region(engine, regions[i+2], i % 2, iterations[i+2], &pending[i+2])))
+	{
+	    for(int j = i + 1; j < n && j < i + 3; ++j)
+	    {
+		release_region(&pending[j]);
+	    }
+	    return false;
+	}
+    }
+    return true;
+}
+
+// Makes sure every device's chunk buffers fit its iterations buffer in the
+// variant's precision
+static bool chunk_buffers(ClEngine *engine, const ClKernelVariant &variant)
+{
+    cl_int ret;
+    size_t state_bytes = (size_t)IMAGE_SIZE*IMAGE_SIZE * (variant.precision == KERNEL_DOUBLE ? sizeof(cl_double2) : sizeof(cl_float2));
+    if(engine->chunk_state_bytes < state_bytes)
+    {
+	for(cl_uint i = 0; i < engine->n_devices; ++i)
+	{
+	    if(engine->chunk_state[i])
+	    {
+		clReleaseMemObject(engine->chunk_state[i]);
+		engine->chunk_state[i] = nullptr;
+	    }
+	}
+	engine->chunk_state_bytes = state_bytes;
+    }
+    for(cl_uint i = 0; i < engine->n_devices; ++i)
+    {
+	if(!engine->chunk_state[i])
+	{
+	    engine->chunk_state[i] = clCreateBuffer(engine->context, CL_MEM_READ_WRITE, engine->chunk_state_bytes, nullptr, &ret);
+	    if(ret != CL_SUCCESS)
+	    {
+		fprintf(stderr, "Unable to create OpenCL chunk state buffer\n");
+		engine->chunk_state[i] = nullptr;
+		return false;
+	    }
+	}
+	if(!engine->chunk_active[i])
+	{
+	    engine->chunk_active[i] = clCreateBuffer(engine->context, CL_MEM_READ_WRITE, sizeof(cl_int), nullptr, &ret);
+	    if(ret != CL_SUCCESS)
+	    {
+		fprintf(stderr, "Unable to create OpenCL chunk counter buffer\n");
+		engine->chunk_active[i] = nullptr;
+		return false;
+	    }
+	}
+    }
+    return true;
+}
+
+// Launches a chunk of every region's band on device and reads back how many
+// of its pixels are still iterating once it's done, into count
+static bool enqueue_chunk(ClEngine *engine, int device, std::vector<ClPendingRegion> &pending, cl_event *marker,
+			  std::vector<cl_event> *kernels_done, cl_int *count, cl_event *count_read)
+{
+    const ClKernelVariant &variant = engine->variants[engine->current];
+    cl_kernel kernel = variant.chunk_kernel;
+    cl_command_queue queue = engine->command_queues[device];
+    
+    // Blocking, or the queue could start the kernels first
+    cl_int zero = 0;
+    if(clEnqueueWriteBuffer(queue, engine->chunk_active[device], CL_TRUE, 0, sizeof(cl_int), &zero, 0, nullptr, nullptr) != CL_SUCCESS)
+    {
+	fprintf(stderr, "Unable to write buffer\n");
+	return false;
+    }
+    
+    clSetKernelArg(kernel, 8, sizeof(cl_mem), (void*)&engine->chunk_state[device]);
+    clSetKernelArg(kernel, 11, sizeof(cl_mem), (void*)&engine->chunk_active[device]);
+    for(ClPendingRegion &region : pending)
+    {
+	int rows = region.band_start[device+1] - region.band_start[device];
+	if(rows == 0)
+	{
+	    continue;
+	}
+	set_region_args(variant, kernel, region.region.origin_x, region.origin_y, region.region.step, region.region.width, region.base);
+	cl_event kernel_done = nullptr;
+	cl_int ret = enqueue_rows(engine, variant, kernel, device, slot_buffer(engine, device, 0),
+				  region.split.compute_row + region.band_start[device], region.region.width, rows,
+				  0, nullptr, engine->profile ? &kernel_done : nullptr);
+	if(ret != CL_SUCCESS)
+	{
+	    fprintf(stderr, "Unable to enqueue task\n");
+	    return false;
+	}
+	if(kernel_done)
+	{
+	    kernels_done->push_back(kernel_done);
+	}
+    }
+
+    if(*marker)
+    {
+	clReleaseEvent(*marker);
+	*marker = nullptr;
+    }
+    if(clEnqueueMarkerWithWaitList(queue, 0, nullptr, marker) != CL_SUCCESS)
+    {
+	*marker = nullptr;
+	fprintf(stderr, "Unable to enqueue marker\n");
+	return false;
+    }
+    if(clEnqueueReadBuffer(queue, engine->chunk_active[device], CL_FALSE, 0, sizeof(cl_int), count, 1, marker, count_read) != CL_SUCCESS)
+    {
+	fprintf(stderr, "Unable to read buffer\n");
+	return false;
+    }
+    return true;
+}
+
+ClRenderResult cl_engine_render_chunked(ClEngine *engine, const RenderRegion *regions, int n, s32 *const *iterations,
+					ClChunkCallback on_chunk, void *user)
+{
+    const ClKernelVariant &variant = engine->variants[engine->current];
+    if(!chunk_buffers(engine, variant))
+    {
+	return CL_RENDER_FAILED;
+    }
+    
+    // The regions follow each other in the devices' buffers, in bands like
+    // cl_engine_render's
+    int n_devices = engine->n_devices;
+    std::vector<ClPendingRegion> pending(n);
+    size_t base = 0;
+    u64 active = 0;
+    for(int i = 0; i < n; ++i)
+    {
+	layout_region(engine, regions[i], base, &pending[i]);
+	base += (size_t)regions[i].width * regions[i].height;
+	active += (u64)regions[i].width * pending[i].split.compute_rows;
+    }
+
+    std::vector<cl_event> markers(n_devices, nullptr);
+    std::vector<std::vector<cl_event>> kernels_done(n_devices);   // only while profiling
+    defer {
+	for(int i = 0; i < n_devices; ++i)
+	{
+	    if(markers[i])
+	    {
+		clReleaseEvent(markers[i]);
+	    }
+	    for(cl_event kernel_done : kernels_done[i])
+	    {
+		clReleaseEvent(kernel_done);
+	    }
+	}
+    };
+    
+    std::vector<cl_int> counts(n_devices);
+    std::vector<cl_event> count_reads(n_devices);
+    int max_iter = variant.max_iter;
+    int start = 0;
+    while(start < max_iter && active > 0)
+    {
+	// Chunks get longer as pixels escape, up to the work a launch may take
+	u64 chunk = CL_CHUNK_WORK / active;
+	chunk = chunk < CL_CHUNK_MIN_ITER ? CL_CHUNK_MIN_ITER : chunk;
+	int end = chunk < (u64)(max_iter - start) ? start + (int)chunk : max_iter;
+	cl_int chunk_start = start;
+	cl_int chunk_end = end;
+	clSetKernelArg(variant.chunk_kernel, 9, sizeof(cl_int), &chunk_start);
+	clSetKernelArg(variant.chunk_kernel, 10, sizeof(cl_int), &chunk_end);
+
+	// Every device's chunk starts before waiting on any
+	int enqueued = 0;
+	bool failed = false;
+	for(; enqueued < n_devices && !failed; ++enqueued)
+	{
+	    count_reads[enqueued] = nullptr;
+	    failed = !enqueue_chunk(engine, enqueued, pending, &markers[enqueued], &kernels_done[enqueued], &counts[enqueued], &count_reads[enqueued]);
+	}
+	active = 0;
+	for(int i = 0; i < enqueued; ++i)
+	{
+	    if(count_reads[i])
+	    {
+		clWaitForEvents(1, &count_reads[i]);
+		clReleaseEvent(count_reads[i]);
+	    }
+	    active += (u64)counts[i];
+	}
+	if(failed)
+	{
+	    return CL_RENDER_FAILED;
+	}
+
+	// The counts waited for the kernels
+	for(int i = 0; i < n_devices; ++i)
+	{
+	    for(cl_event kernel_done : kernels_done[i])
+	    {
+		cl_profile_add(engine->profile, i, PROFILE_KERNEL, kernel_done);
+		clReleaseEvent(kernel_done);
+	    }
+	    kernels_done[i].clear();
+	}
+	start = end;
+	if(on_chunk && !on_chunk(user, start, max_iter, active))
+	{
+	    return CL_RENDER_CANCELLED;
+	}
+    }
+
+    // The markers waited for the last chunk, every read starts before the
+    // host waits on any
+    std::vector<cl_event> reads_done;
+    std::vector<int> read_devices;
+    std::vector<cl_event> no_kernels;
+    std::vector<ClStagedCopy> copies;
+    defer { release_events(&reads_done, &no_kernels); };
+    for(int i = 0; i < n; ++i)
+    {
+	const ClPendingRegion &region = pending[i];
+	int width = region.region.width;
+	for(int d = 0; d < n_devices; ++d)
+	{
+	    int rows = region.band_start[d+1] - region.band_start[d];
+	    if(rows == 0 || !markers[d])
+	    {
+		continue;
+	    }
+	    size_t read_offset = (size_t)(region.split.compute_row + region.band_start[d]) * width;
+	    cl_event read_done = nullptr;
+	    if(!enqueue_read(engine, d, 0, markers[d], (region.base + read_offset) * sizeof(s32), (size_t)rows * width * sizeof(s32),
+			     iterations[i] + read_offset, &copies, &read_done))
+	    {
+		return CL_RENDER_FAILED;
+	    }
+	    reads_done.push_back(read_done);
+	    read_devices.push_back(d);
+	}
+    }
+    for(size_t i = 0; i < reads_done.size(); ++i)
+    {
+	if(clWaitForEvents(1, &reads_done[i]) != CL_SUCCESS)
+	{
+	    fprintf(stderr, "Unable to read buffer\n");
+	    return CL_RENDER_FAILED;
+	}
+	if(engine->profile)
+	{
+	    cl_profile_add(engine->profile, read_devices[i], PROFILE_READ, reads_done[i]);
+	}
+    }
+    copy_out(&copies);
+    for(int i = 0; i < n; ++i)
+    {
+	if(pending[i].mirrored)
+	{
+	    mirror_rows(pending[i].split, iterations[i], pending[i].region.width * sizeof(s32));
+	}
+    }
+    return CL_RENDER_DONE;
+}
+
+// A batch set is one of the device's iterations buffers
+int cl_engine_batch_limit(const ClEngine * /*engine*/, size_t region_pixels)
+{
+    return (int)((size_t)IMAGE_SIZE*IMAGE_SIZE / region_pixels);
+}
+
+bool cl_engine_enqueue_batch(ClEngine *engine, int device, int set, const RenderRegion *regions, int n, s32 *const *iterations,
+			     cl_event *done)
+{
+    cl_command_queue queue = engine->command_queues[device];
+    const ClKernelVariant &variant = engine->variants[engine->current];
+    std::vector<cl_event> &kernels = engine->batch_kernels[2*device + set];
+    std::vector<cl_event> &reads = engine->batch_reads[2*device + set];
+    std::vector<ClStagedCopy> &copies = engine->batch_copies[2*device + set];
+    auto failed = deferred { release_events(&reads, &kernels); reads.clear(); kernels.clear(); copies.clear(); };
+    
+    size_t base = 0;
+    for(int i = 0; i < n; ++i)
+    {
+	const RenderRegion &region = regions[i];
+	set_region_args(variant, variant.kernel, region.origin_x, region.origin_y, region.step, region.width, base);
+	cl_event kernel_done = nullptr;
+	cl_int ret = enqueue_rows(engine, variant, variant.kernel, device, slot_buffer(engine, device, set), 0, region.width, region.height,
+				  0, nullptr, &kernel_done);
+	if(ret != CL_SUCCESS)
+	{
+	    fprintf(stderr, "Unable to enqueue task\n");
+	    return false;
+	}
+	kernels.push_back(kernel_done);
+
+	// Each region is read back as soon as its kernel is done
+	size_t pixels = (size_t)region.width * region.height;
+	cl_event read_done = nullptr;
+	if(!enqueue_read(engine, device, set, kernel_done, base * sizeof(s32), pixels * sizeof(s32), iterations[i], &copies, &read_done))
+	{
+	    return false;
+	}
+	reads.push_back(read_done);
+	base += pixels;
+    }
+
+    cl_int ret = clEnqueueMarkerWithWaitList(queue, (cl_uint)reads.size(), reads.data(), done);
+    if(ret != CL_SUCCESS)
+    {
+	fprintf(stderr, "Unable to enqueue marker\n");
+	return false;
+    }
+    failed.deactivate();
+    return true;
+}
+
+bool cl_engine_finish_batch(ClEngine *engine, int device, int set, cl_event done)
+{
+    std::vector<cl_event> &kernels = engine->batch_kernels[2*device + set];
+    std::vector<cl_event> &reads = engine->batch_reads[2*device + set];
+    std::vector<ClStagedCopy> &copies = engine->batch_copies[2*device + set];
+    defer {
+	clReleaseEvent(done);
+	release_events(&reads, &kernels);
+	reads.clear();
+	kernels.clear();
+	copies.clear();
+    };
+    if(clWaitForEvents(1, &done) != CL_SUCCESS)
+    {
+	fprintf(stderr, "Unable to read buffer\n");
+	return false;
+    }
+    copy_out(&copies);
+    
+    // The marker waited for the reads, which waited for the kernels
+    if(engine->profile)
+    {
+	for(size_t i = 0; i < kernels.size(); ++i)
+	{
+	    cl_profile_add(engine->profile, device, PROFILE_KERNEL, kernels[i]);
+	    cl_profile_add(engine->profile, device, PROFILE_READ, reads[i]);
+	}
+    }
+    return true;
+}
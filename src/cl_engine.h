@@ -0,0 +1,226 @@
+#ifndef __CL_ENGINE_H__
+#define __CL_ENGINE_H__
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "typedefs.h"
+#include "cpu_render.h"
+#include "load_kernel.h"
+#include "cl_profile.h"
+#include "cl_tuning.h"
+
+#define IMAGE_SIZE 2000
+// Kernel variants kept built at once, the least recently used goes first
+#define CL_ENGINE_MAX_VARIANTS 8
+#define CL_ENGINE_MAX_OPTIONS 256
+// Pixel iterations a launch of cl_engine_render_chunked may take, which
+// keeps each well under driver watchdogs
+#define CL_CHUNK_WORK (1 << 27)
+#define CL_CHUNK_MIN_ITER 64
+
+enum KernelFormula
+{
+    FORMULA_MANDELBROT,   // z^2 + c
+    FORMULA_TRICORN       // conj(z)^2 + c
+};
+
+enum KernelPrecision
+{
+    KERNEL_FLOAT,
+    KERNEL_DOUBLE         // needs cl_khr_fp64 on every device
+};
+
+// What test.cl gets specialized on. Each variant is its own program, with
+// the values baked in as macros so the driver can fold them. max_iter is
+// the exception: it's a kernel argument, so picking a new one never
+// builds, and variants only differing in it are one program.
+struct KernelVariant
+{
+    int max_iter;
+    double bailout;        // escape radius
+    int formula;           // KernelFormula
+    int precision;         // KernelPrecision
+    bool cardioid_check;   // skip the main cardioid and period 2 bulb
+    const char *extra_options;   // e.g. "-cl-fast-relaxed-math", may be null
+};
+
+// The build options of a variant, which also identify its program
+std::string kernel_variant_options(const KernelVariant &variant);
+
+struct ClKernelVariant
+{
+    char options[CL_ENGINE_MAX_OPTIONS];
+    int precision;
+    int max_iter;         // of the last select, passed to every launch
+    KernelBuild *build;   // until the kernel is ready
+    cl_kernel kernel;
+    cl_kernel chunk_kernel;   // from the same program
+    // Work-group x and y for each device, from the tuning table. 0 leaves
+    // them to the driver.
+    size_t *local_sizes;
+    bool tune_pending;    // built, waiting for its turn to be tuned
+    u64 last_used;
+};
+
+// A sweep of work-group shapes for a built variant on a thread of its own,
+// with its own kernel, so rendering carries on meanwhile
+struct ClTuneJob
+{
+    ClKernelVariant variant;            // a copy, its local_sizes are the sweep's
+    std::vector<ClTunedSize> results;   // of the devices that could be timed
+    std::atomic<bool> done;
+    std::thread thread;
+};
+
+// A read that landed in pinned staging, to copy out once it's done
+struct ClStagedCopy
+{
+    const void *from;
+    void *to;
+    size_t bytes;
+};
+
+struct ClEngine
+{
+    cl_context context;
+    // The context shares GL objects with the caller's GL context, every
+    // device does cl_khr_gl_sharing. gl_device runs the GL context.
+    bool gl_sharing;
+    cl_uint gl_device;
+    cl_uint n_devices;
+    cl_device_id *devices;
+    cl_command_queue *command_queues;
+    bool has_double;      // every device does cl_khr_fp64
+    // Pixels per second each device rendered lately, which sizes its share
+    // of the next region. Guessed from the hardware until rates_timed.
+    double *pixel_rates;
+    bool rates_timed;
+    void (*on_built)();
+    // Two slots of IMAGE_SIZE^2 s32 for each device, at 2*device + slot, in
+    // rows as wide as the region. No two devices write to one buffer, and
+    // one slot can be read while a kernel writes the other.
+    cl_mem *iterations;
+    // Integrated GPUs write iterations to host memory, so reading them back
+    // is one copy straight into the caller's memory
+    bool unified;
+    // Otherwise reads DMA into pinned staging, one per iterations buffer and
+    // mapped for good, and the host copies out once a read is done.
+    // Pageable memory would make the driver stage it anyway.
+    cl_mem *staging;
+    s32 **staging_host;
+
+    // Event timings of every kernel and transfer, null unless profiling
+    ClProfile *profile;
+    // Kernels, reads and copies out of staging of batches in flight, per
+    // device and set, timed once they're done
+    std::vector<cl_event> *batch_kernels;
+    std::vector<cl_event> *batch_reads;
+    std::vector<ClStagedCopy> *batch_copies;
+
+    // Fastest work-group shapes of the variants, from CL_TUNING_FILENAME.
+    // With tune, every variant is measured on each device in the
+    // background once it's built, one at a time, and the table saved
+    // again. Until then it renders in the stored or the driver's shapes.
+    ClTuning *tuning;
+    bool tune;
+    ClTuneJob *tune_job;     // the sweep running, if any
+    cl_mem tuning_scratch;   // the benchmark region's iterations
+
+    // Device-resident state of chunked renders for each device, made on the
+    // first: z for every pixel of its iterations buffer, and its count of
+    // pixels still iterating
+    cl_mem *chunk_state;
+    size_t chunk_state_bytes;
+    cl_mem *chunk_active;
+
+    ClKernelVariant variants[CL_ENGINE_MAX_VARIANTS];
+    int n_variants;
+    int current;          // the selected variant, -1 if none
+    u64 use_count;
+};
+
+enum ClEngineFlags
+{
+    CL_ENGINE_PROFILE = 1,   // collect every command's event timings in engine->profile
+    CL_ENGINE_TUNE = 2       // measure work-group shapes, see ClEngine::tune
+};
+
+enum ClEngineState
+{
+    CL_ENGINE_BUILDING,
+    CL_ENGINE_READY,
+    CL_ENGINE_FAILED
+};
+
+// Sets up the first platform's GPUs. Kernels build in the background once
+// selected and call on_built (may be null) from a driver thread when
+// they're done. Prints the reason and returns false when there is nothing
+// usable, so the caller can fall back to the CPU. flags are ClEngineFlags.
+// gl_share (may be null) are the zero terminated context properties of a
+// GL context to share with, see ClEngine::gl_sharing.
+bool cl_engine_init(ClEngine *engine, void (*on_built)(), int flags, const cl_context_properties *gl_share);
+void cl_engine_release(ClEngine *engine);
+// Finishes setting up once the selected variant is built, never blocks
+// before that
+ClEngineState cl_engine_update(ClEngine *engine);
+// Makes variant the one cl_engine_render uses. Variants built before are
+// switched to right away, others start building and are BUILDING until
+// cl_engine_update says otherwise.
+ClEngineState cl_engine_select(ClEngine *engine, const KernelVariant &variant);
+
+// Renders the escape iterations of region (at most IMAGE_SIZE square) with
+// the selected variant and reads them back, -1 where unresolved. Each device
+// renders a band of rows sized by its pixel rate, so they finish together.
+bool cl_engine_render(ClEngine *engine, const RenderRegion &region, s32 *iterations);
+// Renders n regions of at most IMAGE_SIZE^2 pixels in a pipeline, the
+// kernels of each running while the one before it is read back. It only
+// returns once every region is in, so the caller's frame is synchronous.
+// Only the batches below overlap the devices with the host's own work.
+bool cl_engine_render_tiles(ClEngine *engine, const RenderRegion *regions, int n, s32 *const *iterations);
+
+enum ClRenderResult
+{
+    CL_RENDER_DONE,
+    CL_RENDER_CANCELLED,
+    CL_RENDER_FAILED
+};
+
+// Called between the chunks of cl_engine_render_chunked with the
+// iterations done and the pixels still iterating. Returning false cancels.
+typedef bool (*ClChunkCallback)(void *user, int iter_done, int max_iter, u64 active);
+
+// Renders n regions, together at most IMAGE_SIZE^2 pixels, like
+// cl_engine_render but in launches of at most CL_CHUNK_WORK iterations.
+// Chunks keep going only while pixels are iterating, and get longer as
+// they escape. A cancelled render leaves iterations untouched.
+ClRenderResult cl_engine_render_chunked(ClEngine *engine, const RenderRegion *regions, int n, s32 *const *iterations,
+					ClChunkCallback on_chunk, void *user);
+
+// Waits for the selected variant to build, for threads that can block
+ClEngineState cl_engine_wait(ClEngine *engine);
+
+// Batches of regions rendered on one device, for callers that spread the
+// work over the devices themselves, each from its own thread. A batch goes
+// in one of two sets (0 or 1), the device's iterations buffers, so the
+// next batch can run while one is read back. A set fits the returned
+// number of regions of region_pixels. Enqueueing starts the kernels and
+// the reads into iterations, which have to stay until the batch is
+// finished, and done signals once they're all in. It uses the selected
+// variant and isn't thread safe, callers serialize it along with
+// cl_engine_select. Finishing waits for done, only touches the set, and
+// releases done.
+int cl_engine_batch_limit(const ClEngine *engine, size_t region_pixels);
+bool cl_engine_enqueue_batch(ClEngine *engine, int device, int set, const RenderRegion *regions, int n, s32 *const *iterations,
+			     cl_event *done);
+bool cl_engine_finish_batch(ClEngine *engine, int device, int set, cl_event done);
+
+#endif // __CL_ENGINE_H__
@@ -0,0 +1,130 @@
+#include <cstdio>
+#include <cstring>
+
+#ifdef __APPLE__
+#include <OpenCL/cl_gl.h>
+#elif defined(_WIN32)
+#include <CL/cl_gl.h>
+#define GLFW_EXPOSE_NATIVE_WIN32
+#define GLFW_EXPOSE_NATIVE_WGL
+#else
+#include <CL/cl_gl.h>
+#define GLFW_EXPOSE_NATIVE_X11
+#define GLFW_EXPOSE_NATIVE_GLX
+#endif
+#ifndef __APPLE__
+#include <GLFW/glfw3native.h>
+#endif
+
+#include "cl_gl_upload.h"
+
+bool cl_gl_share_properties(GLFWwindow *window, cl_context_properties *properties)
+{
+    // macOS shares through cl_APPLE_gl_sharing instead, and EGL contexts
+    // through cl_khr_egl_image, neither of which this does
+#ifdef __APPLE__
+    (void)window;
+    (void)properties;
+    return false;
+#else
+    if(glfwGetWindowAttrib(window, GLFW_CONTEXT_CREATION_API) != GLFW_NATIVE_CONTEXT_API)
+    {
+	return false;
+    }
+#ifdef _WIN32
+    properties[0] = CL_GL_CONTEXT_KHR;
+    properties[1] = (cl_context_properties)glfwGetWGLContext(window);
+    properties[2] = CL_WGL_HDC_KHR;
+    properties[3] = (cl_context_properties)GetDC(glfwGetWin32Window(window));
+#else
+    properties[0] = CL_GL_CONTEXT_KHR;
+    properties[1] = (cl_context_properties)glfwGetGLXContext(window);
+    properties[2] = CL_GLX_DISPLAY_KHR;
+    properties[3] = (cl_context_properties)glfwGetX11Display();
+#endif
+    properties[4] = 0;
+    return properties[1] != 0 && properties[3] != 0;
+#endif
+}
+
+bool cl_gl_upload_init(ClGlUpload *upload, ClEngine *engine)
+{
+    memset(upload, 0, sizeof(*upload));
+    if(!engine->gl_sharing)
+    {
+	return false;
+    }
+
+    // A queue of its own, so waiting for the upload doesn't wait for renders
+    cl_int ret;
+    upload->queue = clCreateCommandQueue(engine->context, engine->devices[engine->gl_device], 0, &ret);
+    if(ret != CL_SUCCESS)
+    {
+	fprintf(stderr, "Unable to create a command queue for texture uploads. Error code %i\n", ret);
+	upload->queue = nullptr;
+	return false;
+    }
+    upload->context = engine->context;
+    clRetainContext(upload->context);
+    return true;
+}
+
+void cl_gl_upload_release(ClGlUpload *upload)
+{
+    if(upload->image)
+    {
+	clReleaseMemObject(upload->image);
+    }
+    if(upload->queue)
+    {
+	clReleaseCommandQueue(upload->queue);
+    }
+    if(upload->context)
+    {
+	clReleaseContext(upload->context);
+    }
+    memset(upload, 0, sizeof(*upload));
+}
+
+bool cl_gl_upload_iterations(void *user, GLuint texture, int width, int height, const s32 *iterations, bool reallocated)
+{
+    ClGlUpload *upload = (ClGlUpload*)user;
+    if(reallocated && upload->image)
+    {
+	clReleaseMemObject(upload->image);
+	upload->image = nullptr;
+    }
+    cl_int ret;
+    if(!upload->image)
+    {
+	upload->image = clCreateFromGLTexture(upload->context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, texture, &ret);
+	if(ret != CL_SUCCESS)
+	{
+	    // Drivers may not take GL_R32I textures
+	    fprintf(stderr, "OpenCL can't share the iteration texture. Error code %i\n", ret);
+	    upload->image = nullptr;
+	    return false;
+	}
+    }
+
+    // GL has to be done with the texture before OpenCL takes it, and the
+    // other way around
+    glFinish();
+    const size_t origin[3] = {0, 0, 0};
+    const size_t region[3] = {(size_t)width, (size_t)height, 1};
+    ret = clEnqueueAcquireGLObjects(upload->queue, 1, &upload->image, 0, nullptr, nullptr);
+    if(ret == CL_SUCCESS)
+    {
+	ret = clEnqueueWriteImage(upload->queue, upload->image, CL_FALSE, origin, region, (size_t)width * sizeof(s32), 0, iterations,
+				  0, nullptr, nullptr);
+	cl_int released = clEnqueueReleaseGLObjects(upload->queue, 1, &upload->image, 0, nullptr, nullptr);
+	ret = ret == CL_SUCCESS ? released : ret;
+    }
+    cl_int finished = clFinish(upload->queue);
+    if(ret != CL_SUCCESS || finished != CL_SUCCESS)
+    {
+	fprintf(stderr, "Unable to write the iteration texture from OpenCL. Error code %i\n", ret != CL_SUCCESS ? ret : finished);
+	return false;
+    }
+    return true;
+}
@@ -0,0 +1,35 @@
+#ifndef __CL_GL_UPLOAD_H__
+#define __CL_GL_UPLOAD_H__
+
+#include "typedefs.h"
+#include "cl_engine.h"
+
+// Room for the properties cl_gl_share_properties fills in
+#define CL_GL_SHARE_PROPERTIES 5
+
+// Frames written into the iteration texture by OpenCL through
+// cl_khr_gl_sharing, as a TextureUploadPath. OpenCL writes the frame into
+// the texture's own storage in one command, where the PBO path copies it
+// into driver memory and then has GL update the texture from there.
+//
+// Frames are composed on the host from cached tiles of every engine, so
+// the kernels can't write the texture themselves: only the upload of the
+// composed frame moves to OpenCL.
+struct ClGlUpload
+{
+    cl_context context;       // the engine's, retained
+    cl_command_queue queue;   // in order, on the device running GL
+    cl_mem image;             // the texture, until its storage changes
+};
+
+// The GL context properties of window for cl_engine_init, zero terminated.
+// False when the platform has no way to share it.
+bool cl_gl_share_properties(GLFWwindow *window, cl_context_properties *properties);
+
+// False unless engine shares the GL context
+bool cl_gl_upload_init(ClGlUpload *upload, ClEngine *engine);
+void cl_gl_upload_release(ClGlUpload *upload);
+// A TextureUploadPath, user is the ClGlUpload
+bool cl_gl_upload_iterations(void *user, GLuint texture, int width, int height, const s32 *iterations, bool reallocated);
+
+#endif // __CL_GL_UPLOAD_H__
@@ -0,0 +1,63 @@
+#include <cstdio>
+
+#include "cl_profile.h"
+
+void cl_profile_init(ClProfile *profile, int n_devices)
+{
+    profile->n_devices = n_devices;
+    profile->times.assign((size_t)n_devices * PROFILE_KINDS, ClCommandTimes{0, 0, 0, 0});
+}
+
+void cl_profile_add(ClProfile *profile, int device, int kind, cl_event event)
+{
+    const cl_profiling_info stages[] = {CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+					CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END};
+    cl_ulong ns[4];
+    for(int i = 0; i < 4; ++i)
+    {
+	if(clGetEventProfilingInfo(event, stages[i], sizeof(ns[i]), &ns[i], nullptr) != CL_SUCCESS)
+	{
+	    return;
+	}
+    }
+    
+    std::lock_guard<std::mutex> guard(profile->lock);
+    ClCommandTimes &times = profile->times[(size_t)device * PROFILE_KINDS + kind];
+    times.count += 1;
+    times.queued += (double)(ns[1] - ns[0]) * 1e-9;
+    times.submitted += (double)(ns[2] - ns[1]) * 1e-9;
+    times.running += (double)(ns[3] - ns[2]) * 1e-9;
+}
+
+void cl_profile_summary(ClProfile *profile, u64 frame)
+{
+    static const char *names[PROFILE_KINDS] = {"kernels", "reads"};
+    
+    std::lock_guard<std::mutex> guard(profile->lock);
+    for(int device = 0; device < profile->n_devices; ++device)
+    {
+	ClCommandTimes *times = &profile->times[(size_t)device * PROFILE_KINDS];
+	u64 count = 0;
+	for(int kind = 0; kind < PROFILE_KINDS; ++kind)
+	{
+	    count += times[kind].count;
+	}
+	if(count == 0)
+	{
+	    continue;
+	}
+
+	// Milliseconds queued / submitted / running, summed over the commands
+	printf("cl frame %llu device %i:", (unsigned long long)frame, device);
+	for(int kind = 0; kind < PROFILE_KINDS; ++kind)
+	{
+	    if(times[kind].count > 0)
+	    {
+		printf(" %llu %s %.2f/%.2f/%.2f ms", (unsigned long long)times[kind].count, names[kind],
+		       1000 * times[kind].queued, 1000 * times[kind].submitted, 1000 * times[kind].running);
+	    }
+	    times[kind] = ClCommandTimes{0, 0, 0, 0};
+	}
+	printf("\n");
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef __CL_PROFILE_H__
+#define __CL_PROFILE_H__
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <mutex>
+#include <vector>
+
+#include "typedefs.h"
+
+enum ClProfileKind
+{
+    PROFILE_KERNEL,
+    PROFILE_READ,
+    PROFILE_KINDS
+};
+
+// Seconds a kind of command spent in each stage, summed
+struct ClCommandTimes
+{
+    u64 count;
+    double queued;    // QUEUED to SUBMIT, waiting on the host side
+    double submitted; // SUBMIT to START, waiting on the device
+    double running;   // START to END
+};
+
+// Event timings of the commands of each device, summed until the next
+// summary. Devices add from their own threads.
+struct ClProfile
+{
+    std::mutex lock;
+    int n_devices;
+    std::vector<ClCommandTimes> times;   // n_devices x PROFILE_KINDS
+};
+
+void cl_profile_init(ClProfile *profile, int n_devices);
+// Adds the timings of a finished command, event stays the caller's
+void cl_profile_add(ClProfile *profile, int device, int kind, cl_event event);
+// Prints a line per device that ran commands since the last summary, with
+// frame to tell them apart in the log, then starts over
+void cl_profile_summary(ClProfile *profile, u64 frame);
+
+#endif // __CL_PROFILE_H__
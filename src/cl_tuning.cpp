@@ -0,0 +1,95 @@
+#include <cstdio>
+#include <cstring>
+
+#include "cl_tuning.h"
+#include "defer.h"
+#include "hash.h"
+
+u64 cl_tuning_key(cl_device_id device, const char *build_options)
+{
+    char name[256] = "";
+    char driver[256] = "";
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, nullptr);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, nullptr);
+
+    u64 h = HASH_SEED;
+    h = hash_bytes(h, name, strlen(name) + 1);
+    h = hash_bytes(h, driver, strlen(driver) + 1);
+    h = hash_bytes(h, build_options, strlen(build_options) + 1);
+    return h;
+}
+
+void cl_tuning_load(ClTuning *tuning, const char *filename)
+{
+    tuning->sizes.clear();
+    FILE *file = fopen(filename, "r");
+    if(!file)
+    {
+	return;
+    }
+    defer { fclose(file); };
+
+    // <key> <local x> <local y> <ms> <label>
+    char line[1024];
+    while(fgets(line, sizeof(line), file))
+    {
+	unsigned long long key;
+	ClTunedSize size;
+	int label_start = 0;
+	if(sscanf(line, "%llx %d %d %lf %n", &key, &size.local_x, &size.local_y, &size.ms, &label_start) < 4 ||
+	   size.local_x < 0 || size.local_y < 0 || (size.local_x == 0) != (size.local_y == 0))
+	{
+	    continue;
+	}
+	size.key = key;
+	size.label = line + label_start;
+	while(!size.label.empty() && (size.label.back() == '\n' || size.label.back() == '\r'))
+	{
+	    size.label.pop_back();
+	}
+	size.measured = false;
+	cl_tuning_store(tuning, size);
+    }
+}
+
+bool cl_tuning_save(const ClTuning *tuning, const char *filename)
+{
+    FILE *file = fopen(filename, "w");
+    if(!file)
+    {
+	fprintf(stderr, "Unable to open '%s' for writing\n", filename);
+	return false;
+    }
+    defer { fclose(file); };
+
+    for(const ClTunedSize &size : tuning->sizes)
+    {
+	fprintf(file, "%016llx %d %d %.4f %s\n", (unsigned long long)size.key, size.local_x, size.local_y, size.ms, size.label.c_str());
+    }
+    return true;
+}
+
+const ClTunedSize *cl_tuning_find(const ClTuning *tuning, u64 key)
+{
+    for(const ClTunedSize &size : tuning->sizes)
+    {
+	if(size.key == key)
+	{
+	    return &size;
+	}
+    }
+    return nullptr;
+}
+
+void cl_tuning_store(ClTuning *tuning, const ClTunedSize &size)
+{
+    for(ClTunedSize &stored : tuning->sizes)
+    {
+	if(stored.key == size.key)
+	{
+	    stored = size;
+	    return;
+	}
+    }
+    tuning->sizes.push_back(size);
+}
@@ -0,0 +1,44 @@
+#ifndef __CL_TUNING_H__
+#define __CL_TUNING_H__
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <string>
+#include <vector>
+
+#include "typedefs.h"
+
+#define CL_TUNING_FILENAME "cl_tuning.txt"
+
+// The fastest work-group shape measured for a kernel variant on a device
+struct ClTunedSize
+{
+    u64 key;              // see cl_tuning_key
+    int local_x;
+    int local_y;          // 0 x 0 is the driver's choice
+    double ms;            // per launch over the benchmark region
+    std::string label;    // device and options, only for people reading the file
+    bool measured;        // in this run, not loaded
+};
+
+// A line per tuned variant and device, small enough to read all at startup
+struct ClTuning
+{
+    std::vector<ClTunedSize> sizes;
+};
+
+// Identifies the device, its driver and the variant's build options, the
+// way the kernel cache does
+u64 cl_tuning_key(cl_device_id device, const char *build_options);
+// A missing file is an empty table. Lines that don't parse are skipped.
+void cl_tuning_load(ClTuning *tuning, const char *filename);
+bool cl_tuning_save(const ClTuning *tuning, const char *filename);
+const ClTunedSize *cl_tuning_find(const ClTuning *tuning, u64 key);
+// Replaces the entry with the same key, if any
+void cl_tuning_store(ClTuning *tuning, const ClTunedSize &size);
+
+#endif // __CL_TUNING_H__
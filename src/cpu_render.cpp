@@ -0,0 +1,196 @@
+#include <cmath>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "cpu_render.h"
+
+// Runs z = z^2 + c from iteration iter up to cap. Returns true and leaves
+// the escape iteration in iter if |z| passed 2, otherwise iter == cap.
+static inline bool iterate(double c_x, double c_y, double &z_x, double &z_y, s32 &iter, s32 cap)
+{
+    for(s32 i = iter; i < cap; ++i)
+    {
+	double t = (z_x + z_y)*(z_x - z_y) + c_x;
+	z_y = 2*z_x*z_y + c_y;
+	z_x = t;
+	if(z_x*z_x + z_y*z_y > 4)
+	{
+	    iter = i;
+	    return true;
+	}
+    }
+    iter = cap;
+    return false;
+}
+
+// Same as iterate, also carrying dz/dc = 2*z*dz + 1 along
+static inline bool iterate_state(double c_x, double c_y, PixelState &state, s32 cap)
+{
+    double z_x = state.z_x, z_y = state.z_y;
+    double dz_x = state.dz_x, dz_y = state.dz_y;
+    bool escaped = false;
+    
+    s32 i = state.iter;
+    for(; i < cap; ++i)
+    {
+	double t = 2*(z_x*dz_x - z_y*dz_y) + 1;
+	dz_y = 2*(z_x*dz_y + z_y*dz_x);
+	dz_x = t;
+	
+	t = (z_x + z_y)*(z_x - z_y) + c_x;
+	z_y = 2*z_x*z_y + c_y;
+	z_x = t;
+	if(z_x*z_x + z_y*z_y > 4)
+	{
+	    escaped = true;
+	    break;
+	}
+    }
+
+    state.iter = i;
+    state.z_x = z_x;
+    state.z_y = z_y;
+    state.dz_x = (float)dz_x;
+    state.dz_y = (float)dz_y;
+    return escaped;
+}
+
+void cpu_iterate(const RenderRegion &region, int cap, s32 *iterations, std::vector<PixelState> *unresolved)
+{
+    for(int y = 0; y < region.height; ++y)
+    {
+	double c_y = region.origin_y + y * region.step;
+	for(int x = 0; x < region.width; ++x)
+	{
+	    double c_x = region.origin_x + x * region.step;
+	    u32 index = (u32)y * region.width + x;
+
+	    PixelState state = {index, 0, 0, 0, 0, 0};
+	    if(iterate_state(c_x, c_y, state, cap))
+	    {
+		iterations[index] = state.iter;
+	    }
+	    else
+	    {
+		iterations[index] = -1;
+		unresolved->push_back(state);
+	    }
+	}
+    }
+}
+
+void cpu_resume(const RenderRegion &region, int cap, s32 *iterations, std::vector<PixelState> *unresolved)
+{
+    size_t n_kept = 0;
+    for(PixelState state : *unresolved)
+    {
+	double c_x = region.origin_x + (state.index % region.width) * region.step;
+	double c_y = region.origin_y + (state.index / region.width) * region.step;
+	if(iterate_state(c_x, c_y, state, cap))
+	{
+	    iterations[state.index] = state.iter;
+	}
+	else
+	{
+	    (*unresolved)[n_kept++] = state;
+	}
+    }
+    unresolved->resize(n_kept);
+
+    // Give the memory of escaped pixels back once it is worth it
+    if(unresolved->size() < unresolved->capacity() / 2)
+    {
+	unresolved->shrink_to_fit();
+    }
+}
+
+// Bailout for the smooth fraction and distance estimate. Escape counts
+// still use radius 2 so they agree with every other renderer, the extra
+// iterations only settle the fractions.
+#define DETAIL_RADIUS_SQUARED 65536.0
+#define DETAIL_EXTRA_ITER 16
+
+void cpu_escape_details(double c_x, double c_y, int cap, s32 *iter, float *fraction, float *distance)
+{
+    PixelState state = {0, 0, 0, 0, 0, 0};
+    if(!iterate_state(c_x, c_y, state, cap))
+    {
+	*iter = -1;
+	*fraction = 0;
+	*distance = 0;
+	return;
+    }
+
+    // z is just past radius 2, carry on to the large radius
+    double z_x = state.z_x, z_y = state.z_y;
+    double dz_x = state.dz_x, dz_y = state.dz_y;
+    s32 n = state.iter;
+    for(s32 i = 0; i < DETAIL_EXTRA_ITER && z_x*z_x + z_y*z_y <= DETAIL_RADIUS_SQUARED; ++i)
+    {
+	double t = 2*(z_x*dz_x - z_y*dz_y) + 1;
+	dz_y = 2*(z_x*dz_y + z_y*dz_x);
+	dz_x = t;
+	
+	t = (z_x + z_y)*(z_x - z_y) + c_x;
+	z_y = 2*z_x*z_y + c_y;
+	z_x = t;
+	++n;
+    }
+
+    double z_abs = std::sqrt(z_x*z_x + z_y*z_y);
+    double dz_abs = std::sqrt(dz_x*dz_x + dz_y*dz_y);
+    double smooth = n + 1 - std::log2(std::log2(z_abs));
+    
+    *iter = state.iter;
+    *fraction = (float)(smooth - state.iter);
+    *distance = dz_abs > 0 ? (float)(z_abs * std::log(z_abs) / dz_abs) : 0;
+}
+
+u32 escape_color(s32 iter, int max_iter)
+{
+    if(iter < 0)
+    {
+	return 0xFFu << 24;
+    }
+    u32 grey = (u32)(255.0f * (float)iter / (float)max_iter + 0.5f);
+    return grey | (grey << 8) | (grey << 16) | (0xFFu << 24);
+}
+
+static void render_rows(const RenderRegion &region, u32 *pixels, int first_row, int row_stride)
+{
+    for(int y = first_row; y < region.height; y += row_stride)
+    {
+	double c_y = region.origin_y + y * region.step;
+	u32 *row = pixels + (size_t)y * region.width;
+	
+	for(int x = 0; x < region.width; ++x)
+	{
+	    double c_x = region.origin_x + x * region.step;
+	    double z_x = 0, z_y = 0;
+	    s32 iter = 0;
+	    bool escaped = iterate(c_x, c_y, z_x, z_y, iter, MAX_ITER);
+	    row[x] = escape_color(escaped ? iter : -1, MAX_ITER);
+	}
+    }
+}
+
+void cpu_render(const RenderRegion &region, u32 *pixels, int n_threads)
+{
+    if(n_threads <= 1)
+    {
+	render_rows(region, pixels, 0, 1);
+	return;
+    }
+
+    // Interleave rows so the expensive interior is shared between threads
+    std::vector<std::thread> threads;
+    for(int i = 0; i < n_threads; ++i)
+    {
+	threads.emplace_back(render_rows, std::cref(region), pixels, i, n_threads);
+    }
+    for(auto &thread : threads)
+    {
+	thread.join();
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef __CPU_RENDER_H__
+#define __CPU_RENDER_H__
+
+#include <vector>
+
+#include "typedefs.h"
+
+// Iteration cap, matching test.cl and simple.frag
+#define MAX_ITER 100
+// Cap of the first pass when MAX_ITER is deeper than this
+#define PREVIEW_ITER 64
+
+// A rectangle of the complex plane sampled on a width x height grid.
+// Row 0 is the bottom of the image, matching OpenGL texture layout.
+struct RenderRegion
+{
+    double origin_x, origin_y;
+    double step;
+    int width, height;
+};
+
+// Where a pixel that hit the cap stopped, so a later pass can pick it up
+// without iterating from zero again. The derivative only feeds distance
+// estimates, so it is kept in single precision.
+struct PixelState
+{
+    u32 index;
+    s32 iter;
+    double z_x, z_y;
+    float dz_x, dz_y;
+};
+
+// Iterates every pixel of region up to cap. Escaped pixels get their
+// escape iteration, the rest get -1 and are appended to unresolved.
+void cpu_iterate(const RenderRegion &region, int cap, s32 *iterations, std::vector<PixelState> *unresolved);
+// Continues the unresolved pixels up to cap, dropping the ones that escape
+void cpu_resume(const RenderRegion &region, int cap, s32 *iterations, std::vector<PixelState> *unresolved);
+
+// Iterates one point up to cap. Escaped points also get the smooth
+// fraction, so iter + fraction is the continuous escape count, and the
+// exterior distance estimate in plane units. Unresolved points get -1, 0, 0.
+void cpu_escape_details(double c_x, double c_y, int cap, s32 *iter, float *fraction, float *distance);
+
+// Same grey ramp as test_kernel, unresolved pixels are black
+u32 escape_color(s32 iter, int max_iter);
+
+// Renders RGBA8 pixels with the same coloring as test_kernel
+void cpu_render(const RenderRegion &region, u32 *pixels, int n_threads);
+
+#endif // __CPU_RENDER_H__
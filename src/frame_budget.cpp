@@ -0,0 +1,92 @@
+#include <cmath>
+
+#include "frame_budget.h"
+
+void frame_budget_init(FrameBudget *budget, double refresh_rate)
+{
+    // Leave a quarter of the refresh interval for upload, blit and present
+    budget->target_seconds = 0.75 / refresh_rate;
+    budget->idle_seconds = 0.15;
+    budget->min_scale = 0.25f;
+
+    budget->seconds_per_pixel = 0;
+    budget->last_input_time = 0;
+    budget->last_scale = 1;
+}
+
+void frame_budget_input(FrameBudget *budget, double now)
+{
+    budget->last_input_time = now;
+}
+
+float frame_budget_scale(const FrameBudget *budget, int full_width, int full_height)
+{
+    double predicted = budget->seconds_per_pixel * full_width * full_height;
+    if(predicted <= budget->target_seconds)
+    {
+	return 1;
+    }
+
+    // Pixel count goes with the square of the linear scale
+    float scale = (float) std::sqrt(budget->target_seconds / predicted);
+
+    // Quantize so small cost jitter doesn't resize the target every frame
+    scale = std::floor(scale * 16) / 16;
+    if(scale < budget->min_scale)
+    {
+	scale = budget->min_scale;
+    }
+    return scale;
+}
+
+bool frame_budget_refine_due(const FrameBudget *budget, double now)
+{
+    return budget->last_scale < 1 && frame_budget_idle(budget, now);
+}
+
+bool frame_budget_idle(const FrameBudget *budget, double now)
+{
+    return now - budget->last_input_time >= budget->idle_seconds;
+}
+
+double frame_budget_wait_time(const FrameBudget *budget, double now)
+{
+    if(budget->last_scale >= 1)
+    {
+	return -1;
+    }
+    return frame_budget_idle_wait(budget, now);
+}
+
+double frame_budget_idle_wait(const FrameBudget *budget, double now)
+{
+    double wait = budget->idle_seconds - (now - budget->last_input_time);
+    return wait > 0 ? wait : 0;
+}
+
+void frame_budget_record(FrameBudget *budget, float scale, int width, int height, double seconds)
+{
+    budget->last_scale = scale;
+    
+    if(width <= 0 || height <= 0)
+    {
+	return;
+    }
+    double cost = seconds / ((double)width * (double)height);
+    if(budget->seconds_per_pixel == 0)
+    {
+	budget->seconds_per_pixel = cost;
+    }
+    else
+    {
+	budget->seconds_per_pixel = 0.7 * budget->seconds_per_pixel + 0.3 * cost;
+    }
+}
+
+void scaled_size(float scale, int width, int height, int *width_out, int *height_out)
+{
+    int w = (int)(width * scale);
+    int h = (int)(height * scale);
+    *width_out = w > 0 ? w : 1;
+    *height_out = h > 0 ? h : 1;
+}
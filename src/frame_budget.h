@@ -0,0 +1,31 @@
+#ifndef __FRAME_BUDGET_H__
+#define __FRAME_BUDGET_H__
+
+// Chooses a render resolution during interaction so a frame fits in the
+// time budget, then asks for one full resolution pass once input goes idle.
+struct FrameBudget
+{
+    double target_seconds;     // render time we aim for while interacting
+    double idle_seconds;       // quiet time before the full resolution pass
+    float min_scale;
+    
+    double seconds_per_pixel;  // smoothed measured cost, 0 until first frame
+    double last_input_time;
+    float last_scale;
+};
+
+void frame_budget_init(FrameBudget *budget, double refresh_rate);
+void frame_budget_input(FrameBudget *budget, double now);
+float frame_budget_scale(const FrameBudget *budget, int full_width, int full_height);
+bool frame_budget_refine_due(const FrameBudget *budget, double now);
+// Input has been quiet for idle_seconds
+bool frame_budget_idle(const FrameBudget *budget, double now);
+// Seconds until the full resolution pass is due, negative if none is pending
+double frame_budget_wait_time(const FrameBudget *budget, double now);
+// Seconds until input has been quiet for idle_seconds
+double frame_budget_idle_wait(const FrameBudget *budget, double now);
+void frame_budget_record(FrameBudget *budget, float scale, int width, int height, double seconds);
+
+void scaled_size(float scale, int width, int height, int *width_out, int *height_out);
+
+#endif // __FRAME_BUDGET_H__
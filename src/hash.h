@@ -0,0 +1,22 @@
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <cstddef>
+
+#include "typedefs.h"
+
+#define HASH_SEED 14695981039346656037ull
+
+// 64 bit FNV-1a, chain calls to hash several fields
+inline u64 hash_bytes(u64 h, const void *data, size_t size)
+{
+    const u8 *bytes = (const u8*)data;
+    for(size_t i = 0; i < size; ++i)
+    {
+	h ^= bytes[i];
+	h *= 1099511628211ull;
+    }
+    return h;
+}
+
+#endif // __HASH_H__
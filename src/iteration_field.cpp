@@ -0,0 +1,220 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <functional>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "iteration_field.h"
+#include "tiles.h"
+#include "defer.h"
+
+static u64 align_offset(u64 offset)
+{
+    return (offset + ITERATION_FIELD_ALIGN - 1) / ITERATION_FIELD_ALIGN * ITERATION_FIELD_ALIGN;
+}
+
+static void field_rows(const RenderRegion &region, int max_iter, IterationField *field, int first_row, int row_stride)
+{
+    for(int y = first_row; y < region.height; y += row_stride)
+    {
+	double c_y = region.origin_y + y * region.step;
+	size_t row = (size_t)y * region.width;
+
+	for(int x = 0; x < region.width; ++x)
+	{
+	    double c_x = region.origin_x + x * region.step;
+	    cpu_escape_details(c_x, c_y, max_iter, &field->iterations[row + x],
+			       &field->fractions[row + x], &field->distances[row + x]);
+	}
+    }
+}
+
+void iteration_field_render(const RenderRegion &region, int max_iter, int n_threads, IterationField *field)
+{
+    memset(field, 0, sizeof(*field));
+
+    size_t n_pixels = (size_t)region.width * region.height;
+    IterationFieldHeader &header = field->header;
+    header.magic = ITERATION_FIELD_MAGIC;
+    header.version = ITERATION_FIELD_VERSION;
+    header.width = region.width;
+    header.height = region.height;
+    header.origin_x = region.origin_x;
+    header.origin_y = region.origin_y;
+    header.step = region.step;
+    header.max_iter = max_iter;
+    header.precision = TILE_DOUBLE;
+    header.iterations_offset = align_offset(sizeof(IterationFieldHeader));
+    header.fractions_offset = align_offset(header.iterations_offset + n_pixels*sizeof(s32));
+    header.distances_offset = align_offset(header.fractions_offset + n_pixels*sizeof(float));
+
+    field->iterations = (s32*) malloc(n_pixels*sizeof(s32));
+    field->fractions = (float*) malloc(n_pixels*sizeof(float));
+    field->distances = (float*) malloc(n_pixels*sizeof(float));
+
+    // Interleave rows so the expensive interior is shared between threads
+    std::vector<std::thread> threads;
+    for(int i = 1; i < n_threads; ++i)
+    {
+	threads.emplace_back(field_rows, std::cref(region), max_iter, field, i, n_threads);
+    }
+    field_rows(region, max_iter, field, 0, n_threads > 1 ? n_threads : 1);
+    for(auto &thread : threads)
+    {
+	thread.join();
+    }
+}
+
+bool iteration_field_save(const IterationField &field, const char *filename)
+{
+    FILE *file = fopen(filename, "wb");
+    if(!file)
+    {
+	fprintf(stderr, "Unable to open '%s' for writing\n", filename);
+	return false;
+    }
+    auto remove_file = deferred { remove(filename); };
+
+    const IterationFieldHeader &header = field.header;
+    size_t n_pixels = (size_t)header.width * header.height;
+    const struct { u64 offset; const void *data; size_t bytes; } planes[3] = {
+	{header.iterations_offset, field.iterations, n_pixels*sizeof(s32)},
+	{header.fractions_offset, field.fractions, n_pixels*sizeof(float)},
+	{header.distances_offset, field.distances, n_pixels*sizeof(float)}
+    };
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for(int i = 0; i < 3 && ok; ++i)
+    {
+	ok = fseek(file, planes[i].offset, SEEK_SET) == 0 &&
+	    fwrite(planes[i].data, 1, planes[i].bytes, file) == planes[i].bytes;
+    }
+    ok = fclose(file) == 0 && ok;
+    if(!ok)
+    {
+	fprintf(stderr, "Unable to write iteration field '%s'\n", filename);
+	return false;
+    }
+
+    remove_file.deactivate();
+    return true;
+}
+
+bool iteration_field_map(const char *filename, IterationField *field)
+{
+    memset(field, 0, sizeof(*field));
+
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0)
+    {
+	fprintf(stderr, "Unable to open iteration field '%s': %s\n", filename, std::strerror(errno));
+	return false;
+    }
+    defer { close(fd); };
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IterationFieldHeader))
+    {
+	fprintf(stderr, "'%s' is not an iteration field\n", filename);
+	return false;
+    }
+    size_t bytes = st.st_size;
+
+    void *mapping = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    if(mapping == MAP_FAILED)
+    {
+	fprintf(stderr, "Unable to map iteration field '%s': %s\n", filename, std::strerror(errno));
+	return false;
+    }
+    auto unmap = deferred { munmap(mapping, bytes); };
+
+    const IterationFieldHeader &header = *(const IterationFieldHeader*)mapping;
+    if(header.magic != ITERATION_FIELD_MAGIC || header.version != ITERATION_FIELD_VERSION)
+    {
+	fprintf(stderr, "'%s' is not an iteration field of version %i\n", filename, ITERATION_FIELD_VERSION);
+	return false;
+    }
+
+    u64 n_pixels = (u64)header.width * header.height;
+    const u64 offsets[3] = {header.iterations_offset, header.fractions_offset, header.distances_offset};
+    for(u64 offset : offsets)
+    {
+	if(header.width <= 0 || header.height <= 0 || offset % sizeof(u32) != 0 ||
+	   offset > bytes || n_pixels > (bytes - offset) / sizeof(u32))
+	{
+	    fprintf(stderr, "Iteration field '%s' is truncated or corrupt\n", filename);
+	    return false;
+	}
+    }
+
+    unmap.deactivate();
+    field->header = header;
+    field->iterations = (s32*)((u8*)mapping + header.iterations_offset);
+    field->fractions = (float*)((u8*)mapping + header.fractions_offset);
+    field->distances = (float*)((u8*)mapping + header.distances_offset);
+    field->mapping = mapping;
+    field->mapped_bytes = bytes;
+    return true;
+}
+
+void iteration_field_free(IterationField *field)
+{
+    if(field->mapping)
+    {
+	munmap(field->mapping, field->mapped_bytes);
+    }
+    else
+    {
+	free(field->iterations);
+	free(field->fractions);
+	free(field->distances);
+    }
+    memset(field, 0, sizeof(*field));
+}
+
+RenderRegion iteration_field_region(const IterationField &field)
+{
+    RenderRegion region;
+    region.origin_x = field.header.origin_x;
+    region.origin_y = field.header.origin_y;
+    region.step = field.header.step;
+    region.width = field.header.width;
+    region.height = field.header.height;
+    return region;
+}
+
+void iteration_field_colorize(const IterationField &field, float density, u32 *pixels)
+{
+    size_t n_pixels = (size_t)field.header.width * field.header.height;
+    float pixel_size = (float)field.header.step;
+
+    for(size_t i = 0; i < n_pixels; ++i)
+    {
+	if(field.iterations[i] < 0)
+	{
+	    pixels[i] = 0xFFu << 24;
+	    continue;
+	}
+
+	// Cosine gradient over the continuous escape count
+	float t = density * (field.iterations[i] + field.fractions[i]);
+	float r = 0.5f + 0.5f*std::cos(6.2831853f*(t + 0.00f));
+	float g = 0.5f + 0.5f*std::cos(6.2831853f*(t + 0.15f));
+	float b = 0.5f + 0.5f*std::cos(6.2831853f*(t + 0.30f));
+
+	float shade = field.distances[i] / pixel_size;
+	shade = shade < 1 ? std::sqrt(shade) : 1;
+
+	u32 red = (u32)(255.0f * r * shade + 0.5f);
+	u32 green = (u32)(255.0f * g * shade + 0.5f);
+	u32 blue = (u32)(255.0f * b * shade + 0.5f);
+	pixels[i] = red | (green << 8) | (blue << 16) | (0xFFu << 24);
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef __ITERATION_FIELD_H__
+#define __ITERATION_FIELD_H__
+
+#include <cstddef>
+
+#include "typedefs.h"
+#include "cpu_render.h"
+
+#define ITERATION_FIELD_MAGIC 0x444c4649   // "IFLD"
+#define ITERATION_FIELD_VERSION 1
+// Planes start on this boundary in the file
+#define ITERATION_FIELD_ALIGN 64
+
+// Start of an iteration field file. It's followed by three planes of
+// width x height values, row 0 at the bottom like textures: s32 escape
+// iterations (-1 when unresolved), float smooth fractions and float
+// distance estimates in plane units. Nothing is packed, so a mapped plane
+// goes straight into glTexImage2D as GL_R32I or GL_R32F.
+struct IterationFieldHeader
+{
+    u32 magic;
+    u32 version;
+    s32 width, height;
+    double origin_x, origin_y, step;
+    s32 max_iter;
+    s32 precision;    // TilePrecision
+    u64 iterations_offset, fractions_offset, distances_offset;
+};
+
+// The raw result of a render, so it can be recolored without iterating
+// again. Either owns its planes or points into a read only file mapping.
+struct IterationField
+{
+    IterationFieldHeader header;
+    s32 *iterations;
+    float *fractions;
+    float *distances;
+    void *mapping;
+    size_t mapped_bytes;
+};
+
+// Renders region on the CPU in double precision
+void iteration_field_render(const RenderRegion &region, int max_iter, int n_threads, IterationField *field);
+bool iteration_field_save(const IterationField &field, const char *filename);
+// Maps filename without copying, checking the header against its size
+bool iteration_field_map(const char *filename, IterationField *field);
+void iteration_field_free(IterationField *field);
+
+RenderRegion iteration_field_region(const IterationField &field);
+
+// Smooth coloring with a repeating gradient, density gradient cycles per
+// iteration, darkened within a pixel or so of the set. Unresolved is black.
+void iteration_field_colorize(const IterationField &field, float density, u32 *pixels);
+
+#endif // __ITERATION_FIELD_H__
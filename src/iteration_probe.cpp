@@ -0,0 +1,62 @@
+#include <algorithm>
+#include <vector>
+
+#include "iteration_probe.h"
+
+// Smallest cap the probe will choose
+#define PROBE_MIN_ITER 64
+
+ProbeResult probe_max_iter(const RenderRegion &region, int probe_size, int ceiling, double target_fraction)
+{
+    // Same area, sampled sparsely through pixel centers
+    RenderRegion probe;
+    probe.width = probe_size;
+    probe.height = probe_size;
+    probe.step = region.step * region.height / probe_size;
+    double step_x = region.step * region.width / probe_size;
+    probe.origin_y = region.origin_y + 0.5 * probe.step;
+    
+    std::vector<s32> escapes;
+    escapes.reserve(probe_size*probe_size);
+    std::vector<s32> iterations(probe_size);
+    std::vector<PixelState> unresolved;
+    for(int y = 0; y < probe_size; ++y)
+    {
+	// One row at a time, since the region need not be square
+	RenderRegion row = probe;
+	row.height = 1;
+	row.step = step_x;
+	row.origin_x = region.origin_x + 0.5 * step_x;
+	row.origin_y = probe.origin_y + y * probe.step;
+	
+	cpu_iterate(row, ceiling, iterations.data(), &unresolved);
+	for(s32 iter : iterations)
+	{
+	    if(iter >= 0)
+	    {
+		escapes.push_back(iter);
+	    }
+	}
+    }
+
+    int n_probes = probe_size*probe_size;
+    int allowed = (int)(target_fraction * n_probes);
+    std::sort(escapes.begin(), escapes.end());
+
+    ProbeResult result;
+    result.interior_fraction = (float)unresolved.size() / n_probes;
+    result.max_iter = PROBE_MIN_ITER;
+    if((int)escapes.size() > allowed)
+    {
+	// Everything but the slowest allowed probes escapes below this
+	int needed = escapes[escapes.size() - allowed - 1] + 1;
+	while(result.max_iter < needed && result.max_iter < ceiling)
+	{
+	    result.max_iter *= 2;
+	}
+    }
+    
+    int n_unresolved = (int)(escapes.end() - std::lower_bound(escapes.begin(), escapes.end(), result.max_iter));
+    result.unresolved_fraction = (float)n_unresolved / n_probes;
+    return result;
+}
@@ -0,0 +1,19 @@
+#ifndef __ITERATION_PROBE_H__
+#define __ITERATION_PROBE_H__
+
+#include "cpu_render.h"
+
+struct ProbeResult
+{
+    int max_iter;
+    float unresolved_fraction;  // probes escaping at or after max_iter
+    float interior_fraction;    // probes still bounded at the ceiling
+};
+
+// Iterates a probe_size x probe_size grid over region up to ceiling and
+// picks the smallest power of two max_iter that leaves at most
+// target_fraction of the probes unresolved. Probes that never escape
+// are taken to be inside the set and don't count against the target.
+ProbeResult probe_max_iter(const RenderRegion &region, int probe_size, int ceiling, double target_fraction);
+
+#endif // __ITERATION_PROBE_H__
@@ -0,0 +1,58 @@
+#include <cstdio>
+
+#include "latency.h"
+
+// Frames per printed summary
+#define LATENCY_REPORT_FRAMES 60
+
+void latency_init(LatencyStats *stats)
+{
+    stats->pending_input_time = -1;
+    stats->count = 0;
+    stats->total = 0;
+    stats->max = 0;
+}
+
+void latency_input(LatencyStats *stats, double now)
+{
+    // Only the oldest input counts, later ones ride along in the same frame
+    if(stats->pending_input_time < 0)
+    {
+	stats->pending_input_time = now;
+    }
+}
+
+void latency_presented(LatencyStats *stats, double now)
+{
+    if(stats->pending_input_time < 0)
+    {
+	return;
+    }
+    double latency = now - stats->pending_input_time;
+    stats->pending_input_time = -1;
+
+    stats->count += 1;
+    stats->total += latency;
+    if(latency > stats->max)
+    {
+	stats->max = latency;
+    }
+
+    if(stats->count >= LATENCY_REPORT_FRAMES)
+    {
+	latency_report(stats);
+    }
+}
+
+void latency_report(LatencyStats *stats)
+{
+    if(stats->count == 0)
+    {
+	return;
+    }
+    printf("input to photon: avg %.1f ms, max %.1f ms over %i frames\n",
+	   1000 * stats->total / stats->count, 1000 * stats->max, stats->count);
+    stats->count = 0;
+    stats->total = 0;
+    stats->max = 0;
+}
@@ -0,0 +1,19 @@
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+// Input-to-photon latency: time from the first input that changed the view
+// until the frame showing it has been presented.
+struct LatencyStats
+{
+    double pending_input_time;  // < 0 when no input is waiting to be shown
+    int count;
+    double total;
+    double max;
+};
+
+void latency_init(LatencyStats *stats);
+void latency_input(LatencyStats *stats, double now);
+void latency_presented(LatencyStats *stats, double now);
+void latency_report(LatencyStats *stats);
+
+#endif // __LATENCY_H__
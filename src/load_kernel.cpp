@@ -1,16 +1,165 @@
 #include <cstdio>
 #include <cstring>
 #include <errno.h>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
 
 #include "load_kernel.h"
+#include "hash.h"
 
-bool load_kernel(cl_context context, cl_uint n_devices, const cl_device_id *device_list, const char *program_filename, const char *kernel_name, cl_kernel &out)
+static std::string binary_cache_path(cl_device_id device, const char *source, size_t size, const char *build_options)
 {
+    char name[256] = "";
+    char driver[256] = "";
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, nullptr);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, nullptr);
+
+    // Hash the terminators too, so the fields can't run into each other
+    u64 h = HASH_SEED;
+    h = hash_bytes(h, name, strlen(name) + 1);
+    h = hash_bytes(h, driver, strlen(driver) + 1);
+    h = hash_bytes(h, build_options, strlen(build_options) + 1);
+    h = hash_bytes(h, source, size);
+
+    char path[64];
+    snprintf(path, sizeof(path), KERNEL_CACHE_DIR "/%016llx.bin", (unsigned long long)h);
+    return path;
+}
+
+// Returns a built program if every device has a cached binary that loads
+static cl_program load_cached_program(cl_context context, cl_uint n_devices, const cl_device_id *device_list, const std::vector<std::string> &paths, const char *build_options)
+{
+    std::vector<std::vector<unsigned char>> binaries(n_devices);
+    for(cl_uint i = 0; i < n_devices; ++i)
+    {
+	FILE *file = fopen(paths[i].c_str(), "rb");
+	if(!file)
+	{
+	    return nullptr;
+	}
+	defer { fclose(file); };
+	
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	if(size <= 0)
+	{
+	    return nullptr;
+	}
+	binaries[i].resize(size);
+	if(fread(binaries[i].data(), 1, size, file) != (size_t)size)
+	{
+	    return nullptr;
+	}
+    }
+
+    std::vector<size_t> sizes(n_devices);
+    std::vector<const unsigned char*> pointers(n_devices);
+    for(cl_uint i = 0; i < n_devices; ++i)
+    {
+	sizes[i] = binaries[i].size();
+	pointers[i] = binaries[i].data();
+    }
+
+    cl_int ret;
+    cl_program program = clCreateProgramWithBinary(context, n_devices, device_list, sizes.data(), pointers.data(), nullptr, &ret);
+    if(ret != CL_SUCCESS)
+    {
+	return nullptr;
+    }
+    if(clBuildProgram(program, n_devices, device_list, build_options, nullptr, nullptr) != CL_SUCCESS)
+    {
+	clReleaseProgram(program);
+	return nullptr;
+    }
+    return program;
+}
+
+// Failing to save only costs the next startup a rebuild, so it stays quiet
+static void save_program_binaries(cl_program program, cl_uint n_devices, const std::vector<std::string> &paths)
+{
+    if(mkdir(KERNEL_CACHE_DIR, 0755) != 0 && errno != EEXIST)
+    {
+	return;
+    }
+    
+    // The binaries come in the order the devices were given to the build
+    std::vector<size_t> sizes(n_devices);
+    if(clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, n_devices * sizeof(size_t), sizes.data(), nullptr) != CL_SUCCESS)
+    {
+	return;
+    }
+    std::vector<std::vector<unsigned char>> binaries(n_devices);
+    std::vector<unsigned char*> pointers(n_devices);
+    for(cl_uint i = 0; i < n_devices; ++i)
+    {
+	binaries[i].resize(sizes[i]);
+	pointers[i] = binaries[i].data();
+    }
+    if(clGetProgramInfo(program, CL_PROGRAM_BINARIES, n_devices * sizeof(unsigned char*), pointers.data(), nullptr) != CL_SUCCESS)
+    {
+	return;
+    }
+
+    for(cl_uint i = 0; i < n_devices; ++i)
+    {
+	if(sizes[i] == 0)
+	{
+	    continue;
+	}
+	FILE *file = fopen(paths[i].c_str(), "wb");
+	if(!file)
+	{
+	    continue;
+	}
+	fwrite(binaries[i].data(), 1, sizes[i], file);
+	fclose(file);
+    }
+}
+
+static bool build_release(KernelBuild *build)
+{
+    std::lock_guard<std::mutex> guard(build->lock);
+    return --build->refs == 0;
+}
+
+static void CL_CALLBACK build_notify(cl_program /*program*/, void *user_data)
+{
+    KernelBuild *build = (KernelBuild*)user_data;
+    void (*on_done)() = build->on_done;
+    bool last;
+    {
+	// Notify before unlocking, the finisher may free the build as soon
+	// as it gets the lock
+	std::lock_guard<std::mutex> guard(build->lock);
+	build->done = true;
+	build->done_cond.notify_all();
+	last = --build->refs == 0;
+    }
+    if(last)
+    {
+	delete build;
+    }
+    if(on_done)
+    {
+	on_done();
+    }
+}
+
+KernelBuild *kernel_build_start(cl_context context, cl_uint n_devices, const cl_device_id *device_list, const char *program_filename, const char *build_options, void (*on_done)())
+{
+    auto start_time = std::chrono::steady_clock::now();
+    if(!build_options)
+    {
+	build_options = "";
+    }
+    
     FILE *program_file = fopen(program_filename, "r");
     if(!program_file)
     {
 	fprintf(stderr, "Unable to create program: error opening file '%s': %s\n", program_filename, std::strerror(errno));
-	return false;
+	return nullptr;
     }
     defer { fclose(program_file); };
 
@@ -21,7 +170,7 @@ bool load_kernel(cl_context context, cl_uint n_devices, const cl_device_id *devi
     if(ferror(program_file))
     {
 	fprintf(stderr, "Unable to create program: error getting size of file '%s'\n", program_filename);
-	return false;
+	return nullptr;
     }
 
     char *buffer = (char*) malloc(size);
@@ -31,59 +180,126 @@ bool load_kernel(cl_context context, cl_uint n_devices, const cl_device_id *devi
     if(ferror(program_file))
     {
 	fprintf(stderr, "Unable to create program: error reading from file '%s': %s\n", program_filename, std::strerror(errno));
-	return false;
+	return nullptr;
+    }
+
+    KernelBuild *build = new KernelBuild;
+    auto free_build = deferred { delete build; };
+    build->n_devices = n_devices;
+    build->devices = device_list;
+    build->start_time = start_time;
+    build->on_done = on_done;
+    build->refs = 1;
+    for(cl_uint i = 0; i < n_devices; ++i)
+    {
+	build->cache_paths.push_back(binary_cache_path(device_list[i], buffer, bytes_read, build_options));
+    }
+
+    // Loading a cached binary is quick enough to just do here
+    build->program = load_cached_program(context, n_devices, device_list, build->cache_paths, build_options);
+    build->cached = build->program != nullptr;
+    if(build->cached)
+    {
+	build->done = true;
+	free_build.deactivate();
+	return build;
     }
     
     cl_int ret;
-    cl_program program = clCreateProgramWithSource(context, 1, (const char **)&buffer, (const size_t *)&size, &ret);
+    build->program = clCreateProgramWithSource(context, 1, (const char **)&buffer, (const size_t *)&size, &ret);
     if(ret == CL_OUT_OF_HOST_MEMORY)
     {
 	fprintf(stderr, "Unable to create program: out of host memory\n");
-	return false;
+	return nullptr;
     }
     else if(ret != CL_SUCCESS)
     {
 	fprintf(stderr, "Unable to create program: error creating program: error code %i\n", ret);
-	return false;
+	return nullptr;
     }
+    auto release_program = deferred { clReleaseProgram(build->program); };
+
+    // With a callback the driver may return right away and build on its own
+    // threads, the callback gets its own reference. When it returns an
+    // error other than a failed build, the build never started and there
+    // is no callback.
+    build->done = false;
+    build->refs = 2;
+    ret = clBuildProgram(build->program, n_devices, device_list, build_options, build_notify, build);
+    if(ret == CL_BUILD_PROGRAM_FAILURE)
+    {
+	// A build that failed before returning may or may not still call
+	// back, depending on the driver. Its reference stays with the
+	// callback either way: at worst a failed build leaks this struct.
+	std::lock_guard<std::mutex> guard(build->lock);
+	build->done = true;
+    }
+    else if(ret == CL_OUT_OF_HOST_MEMORY)
+    {
+	fprintf(stderr, "Unable to create program: out of host memory\n");
+	return nullptr;
+    }
+    else if(ret != CL_SUCCESS)
+    {
+	fprintf(stderr, "Unable to create program: error building program: error code %i\n", ret);
+	return nullptr;
+    }
+
+    release_program.deactivate();
+    free_build.deactivate();
+    return build;
+}
 
+bool kernel_build_done(KernelBuild *build)
+{
+    std::lock_guard<std::mutex> guard(build->lock);
+    return build->done;
+}
+
+bool kernel_build_finish(KernelBuild *build, const char *kernel_name, cl_kernel &out)
+{
+    defer
+    {
+	if(build_release(build))
+	{
+	    delete build;
+	}
+    };
+    {
+	std::unique_lock<std::mutex> guard(build->lock);
+	build->done_cond.wait(guard, [build] { return build->done; });
+    }
+    cl_program program = build->program;
     defer { clReleaseProgram(program); };
 
-    ret = clBuildProgram(program, n_devices, device_list, nullptr, nullptr, nullptr);
-    if(ret == CL_BUILD_PROGRAM_FAILURE)
+    for(cl_uint i = 0; i < build->n_devices; ++i)
     {
-	// TODO for all devices?
+	cl_build_status status = CL_BUILD_ERROR;
+	clGetProgramBuildInfo(program, build->devices[i], CL_PROGRAM_BUILD_STATUS, sizeof(status), &status, nullptr);
+	if(status == CL_BUILD_SUCCESS)
+	{
+	    continue;
+	}
+	
 	size_t log_size;
-	clGetProgramBuildInfo(program, device_list[0], CL_PROGRAM_BUILD_LOG, 0, nullptr, &log_size);
+	clGetProgramBuildInfo(program, build->devices[i], CL_PROGRAM_BUILD_LOG, 0, nullptr, &log_size);
 
 	char *program_log = (char*) malloc(log_size+1);
 	defer { free(program_log); };
 	program_log[log_size] = '\0';
 
-	clGetProgramBuildInfo(program, device_list[0], CL_PROGRAM_BUILD_LOG, log_size, program_log, nullptr);
+	clGetProgramBuildInfo(program, build->devices[i], CL_PROGRAM_BUILD_LOG, log_size, program_log, nullptr);
 	
 	fprintf(stderr, "Unable to create program: build failure\n%s\n", program_log);
 	return false;
     }
-    else if(ret == CL_OUT_OF_HOST_MEMORY)
-    {
-	fprintf(stderr, "Unable to create program: out of host memory\n");
-	return false;
-    }
-    else if(ret != CL_SUCCESS)
+
+    if(!build->cached)
     {
-	fprintf(stderr, "Unable to create program: error building program: error code %i\n", ret);
-	return false;
+	save_program_binaries(program, build->n_devices, build->cache_paths);
     }
-
-/*
-        clGetProgramBuildInfo(program, device, 
-                CL_PROGRAM_BUILD_LOG, logSize+1, programLog, NULL);
-        printf("Build failed; error=%d, status=%d, programLog:nn%s", 
-                error, status, programLog);
-        free(programLog);
- */
     
+    cl_int ret;
     out = clCreateKernel(program, kernel_name, &ret);
 
     if(ret == CL_INVALID_KERNEL_NAME)
@@ -107,5 +323,14 @@ bool load_kernel(cl_context context, cl_uint n_devices, const cl_device_id *devi
 	return false;
     }
 
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - build->start_time).count();
+    printf("Kernel '%s' ready in %.3f s, %s\n", kernel_name, seconds, build->cached ? "from cached binaries" : "built from source");
+
     return true;
 }
+
+bool load_kernel(cl_context context, cl_uint n_devices, const cl_device_id *device_list, const char *program_filename, const char *kernel_name, const char *build_options, cl_kernel &out)
+{
+    KernelBuild *build = kernel_build_start(context, n_devices, device_list, program_filename, build_options, nullptr);
+    return build && kernel_build_finish(build, kernel_name, out);
+}
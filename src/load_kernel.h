@@ -7,6 +7,44 @@
 #include <CL/cl.h>
 #endif
 
-bool load_kernel(cl_context context, cl_uint n_devices, const cl_device_id *device_list, const char *program_filename, const char *kernel_name, cl_kernel &out);
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define KERNEL_CACHE_DIR "kernel_cache"
+
+// Built programs are cached in KERNEL_CACHE_DIR per device, keyed by the
+// device, its driver, build_options and the source. A cached binary that
+// fails to load is rebuilt from source.
+bool load_kernel(cl_context context, cl_uint n_devices, const cl_device_id *device_list, const char *program_filename, const char *kernel_name, const char *build_options, cl_kernel &out);
+
+// The same in steps, so the caller can get on with other work while the
+// driver builds the program
+struct KernelBuild
+{
+    cl_program program;
+    cl_uint n_devices;
+    const cl_device_id *devices;   // the caller's, kept alive until finish
+    std::vector<std::string> cache_paths;
+    bool cached;
+    std::chrono::steady_clock::time_point start_time;
+
+    std::mutex lock;
+    std::condition_variable done_cond;
+    bool done;
+    void (*on_done)();
+    // The finisher holds one reference, a pending driver callback the other.
+    // Whoever drops the last one frees the build.
+    int refs;
+};
+
+// Returns null on errors. Cached binaries are loaded right away, a build
+// from source calls on_done (may be null) from a driver thread when it ends.
+KernelBuild *kernel_build_start(cl_context context, cl_uint n_devices, const cl_device_id *device_list, const char *program_filename, const char *build_options, void (*on_done)());
+bool kernel_build_done(KernelBuild *build);
+// Waits for the build if needed, then creates the kernel. Frees build.
+bool kernel_build_finish(KernelBuild *build, const char *kernel_name, cl_kernel &out);
 
 #endif // __LOAD_KERNEL_H__
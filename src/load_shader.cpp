@@ -1,143 +1,297 @@
+#include <chrono>
 #include <cstdio>
 #include <cstring>
+#include <errno.h>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
 
 #include "defer.h"
+#include "hash.h"
 #include "load_shader.h"
 #include "glad/glad.h"
 
-bool load_shader_program(const char *vertex_file, const char *fragment_file, GLuint *id_out)
+static bool read_shader_file(const char *filename, std::string *out)
 {
-    FILE *vert_shader_file = fopen(vertex_file, "r");
-    if(!vert_shader_file)
+    FILE *file = fopen(filename, "r");
+    if(!file)
     {
-	fprintf(stderr, "Unable to open file '%s': %s\n", vertex_file, std::strerror(errno));
+	fprintf(stderr, "Unable to open file '%s': %s\n", filename, std::strerror(errno));
 	return false;
     }
-    defer { fclose(vert_shader_file); };
-    
-    FILE *frag_shader_file = fopen(fragment_file, "r");
-    if(!frag_shader_file)
-    {
-	fprintf(stderr, "Unable to open file '%s': %s\n", fragment_file, std::strerror(errno));
-	return false;
-    }
-    defer { fclose(frag_shader_file); };
+    defer { fclose(file); };
 
-    GLuint vert_shader_id = glCreateShader(GL_VERTEX_SHADER);
-    GLuint frag_shader_id = glCreateShader(GL_FRAGMENT_SHADER);
-    
-    defer {
-	glDeleteShader(vert_shader_id);
-	glDeleteShader(frag_shader_id);
-    };
-    
     char buffer[8192];
-    // frankly, I don't know why this is necessary, the compiler complained
-    const char *buffer_ptr = buffer;
-    
-    while(!feof(vert_shader_file))
+    out->clear();
+    while(!feof(file))
     {
-	size_t n_read = fread(buffer, 1, 8192, vert_shader_file);
-	if(ferror(vert_shader_file))
+	size_t n_read = fread(buffer, 1, sizeof(buffer), file);
+	if(ferror(file))
 	{
-	    fprintf(stderr, "Unable to read file '%s'\n", vertex_file);
+	    fprintf(stderr, "Unable to read file '%s'\n", filename);
 	    return false;
 	}
-	GLint len = n_read;
-	glShaderSource(vert_shader_id, 1, &buffer_ptr, &len);
+	out->append(buffer, n_read);
     }
-    while(!feof(frag_shader_file))
+    return true;
+}
+
+// The defines go right after the #version line, which has to come first
+static void insert_defines(std::string *source, const char *defines)
+{
+    size_t at = 0;
+    if(source->compare(0, 8, "#version") == 0)
     {
-	size_t n_read = fread(buffer, 1, 8192, frag_shader_file);
-	if(ferror(frag_shader_file))
+	size_t line_end = source->find('\n');
+	at = line_end == std::string::npos ? source->size() : line_end + 1;
+    }
+    source->insert(at, defines);
+}
+
+// Empty when the driver can't hand out program binaries
+static std::string shader_cache_path(const std::string &vert_source, const std::string &frag_source)
+{
+    GLint n_formats = 0;
+    if(GLAD_GL_ARB_get_program_binary && glGetProgramBinary)
+    {
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &n_formats);
+    }
+    if(n_formats <= 0)
+    {
+	return "";
+    }
+
+    // Hash the terminators too, so the fields can't run into each other
+    u64 h = HASH_SEED;
+    const GLenum driver_strings[] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+    for(GLenum name : driver_strings)
+    {
+	const char *value = (const char*)glGetString(name);
+	if(value)
 	{
-	    fprintf(stderr, "Unable to read file '%s'\n", fragment_file);
-	    return false;
+	    h = hash_bytes(h, value, strlen(value));
 	}
-	GLint len = n_read;
-	glShaderSource(frag_shader_id, 1, &buffer_ptr, &len);
+	h = hash_bytes(h, "", 1);
     }
+    h = hash_bytes(h, vert_source.c_str(), vert_source.size() + 1);
+    h = hash_bytes(h, frag_source.c_str(), frag_source.size() + 1);
 
+    char path[64];
+    snprintf(path, sizeof(path), SHADER_CACHE_DIR "/%016llx.bin", (unsigned long long)h);
+    return path;
+}
 
-    glCompileShader(vert_shader_id);
-    glCompileShader(frag_shader_id);
-    
-    GLint compile_success;
-    glGetShaderiv(vert_shader_id, GL_COMPILE_STATUS, &compile_success);
-    
-    if(!compile_success)
+// Cache files hold the binary format followed by the binary
+static GLuint load_cached_shader_program(const std::string &path)
+{
+    if(path.empty())
+    {
+	return 0;
+    }
+    FILE *file = fopen(path.c_str(), "rb");
+    if(!file)
     {
-	GLint info_log_len;
-	glGetShaderiv(vert_shader_id, GL_INFO_LOG_LENGTH, &info_log_len);
+	return 0;
+    }
+    defer { fclose(file); };
 
-	char *log_buffer = buffer;
-	auto free_buffer = maybe { free(log_buffer); }; 
-	if(info_log_len > 8192)
-	{
-	    char *log_buffer = (char*)malloc(info_log_len);
-	    free_buffer.activate();
-	}
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if(size <= (long)sizeof(GLenum))
+    {
+	return 0;
+    }
+    GLenum format;
+    std::vector<char> binary(size - sizeof(GLenum));
+    if(fread(&format, sizeof(format), 1, file) != 1 || fread(binary.data(), 1, binary.size(), file) != binary.size())
+    {
+	return 0;
+    }
 
-	glGetShaderInfoLog(vert_shader_id, info_log_len, nullptr, log_buffer);
-	
-	fprintf(stderr, "Error compiling vertex shader:\n%s\n", log_buffer);
-	return false;
+    // Drivers reject binaries from other versions of themselves
+    GLuint program_id = glCreateProgram();
+    glProgramBinary(program_id, format, binary.data(), binary.size());
+    GLint link_success;
+    glGetProgramiv(program_id, GL_LINK_STATUS, &link_success);
+    if(!link_success)
+    {
+	glDeleteProgram(program_id);
+	return 0;
     }
+    return program_id;
+}
 
-    glGetShaderiv(frag_shader_id, GL_COMPILE_STATUS, &compile_success);
+static void save_shader_program_binary(GLuint program_id, const std::string &path)
+{
+    if(path.empty() || (mkdir(SHADER_CACHE_DIR, 0755) != 0 && errno != EEXIST))
+    {
+	return;
+    }
     
-    if(!compile_success)
+    GLint length = 0;
+    glGetProgramiv(program_id, GL_PROGRAM_BINARY_LENGTH, &length);
+    if(length <= 0)
     {
-	GLint info_log_len;
-	glGetShaderiv(frag_shader_id, GL_INFO_LOG_LENGTH, &info_log_len);
+	return;
+    }
+    GLenum format;
+    std::vector<char> binary(length);
+    glGetProgramBinary(program_id, length, &length, &format, binary.data());
 
-	char *log_buffer = buffer;
-	auto free_buffer = maybe { free(log_buffer); }; 
-	if(info_log_len > 8192)
-	{
-	    char *log_buffer = (char*)malloc(info_log_len);
-	    free_buffer.activate();
-	}
+    FILE *file = fopen(path.c_str(), "wb");
+    if(!file)
+    {
+	return;
+    }
+    fwrite(&format, sizeof(format), 1, file);
+    fwrite(binary.data(), 1, length, file);
+    fclose(file);
+}
+
+// Copies the info log of a shader or program into a string
+static std::string info_log(GLuint id, bool program)
+{
+    GLint info_log_len = 0;
+    if(program)
+    {
+	glGetProgramiv(id, GL_INFO_LOG_LENGTH, &info_log_len);
+    }
+    else
+    {
+	glGetShaderiv(id, GL_INFO_LOG_LENGTH, &info_log_len);
+    }
+    
+    std::string log(info_log_len > 0 ? info_log_len : 1, '\0');
+    if(program)
+    {
+	glGetProgramInfoLog(id, log.size(), nullptr, &log[0]);
+    }
+    else
+    {
+	glGetShaderInfoLog(id, log.size(), nullptr, &log[0]);
+    }
+    return log;
+}
 
-	glGetShaderInfoLog(frag_shader_id, info_log_len, nullptr, log_buffer);
-	
-	fprintf(stderr, "Error compiling fragment shader:\n%s\n", log_buffer);
+bool shader_build_start(const char *vertex_file, const char *fragment_file, const char *defines, ShaderBuild *build)
+{
+    build->start_time = std::chrono::steady_clock::now();
+    build->fragment_file = fragment_file;
+    build->vert_shader_id = 0;
+    build->frag_shader_id = 0;
+    
+    std::string vert_source, frag_source;
+    if(!read_shader_file(vertex_file, &vert_source) || !read_shader_file(fragment_file, &frag_source))
+    {
 	return false;
     }
-	
-    GLuint program_id = glCreateProgram();
-	
-    glAttachShader(program_id, vert_shader_id);
-    glAttachShader(program_id, frag_shader_id);
+    if(defines)
+    {
+	insert_defines(&vert_source, defines);
+	insert_defines(&frag_source, defines);
+    }
 
-    defer {
-	glDetachShader(program_id, vert_shader_id);
-	glDetachShader(program_id, frag_shader_id);
-    };
-	
-    glLinkProgram(program_id);
+    build->cache_path = shader_cache_path(vert_source, frag_source);
+    build->program_id = load_cached_shader_program(build->cache_path);
+    if(build->program_id)
+    {
+	return true;
+    }
 
-    glGetProgramiv(program_id, GL_LINK_STATUS, &compile_success);
+    // Let the driver compile on as many threads as it likes
+    if(GLAD_GL_ARB_parallel_shader_compile)
+    {
+	glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+    }
+
+    build->vert_shader_id = glCreateShader(GL_VERTEX_SHADER);
+    build->frag_shader_id = glCreateShader(GL_FRAGMENT_SHADER);
 
+    const char *vert_ptr = vert_source.c_str();
+    const char *frag_ptr = frag_source.c_str();
+    glShaderSource(build->vert_shader_id, 1, &vert_ptr, nullptr);
+    glShaderSource(build->frag_shader_id, 1, &frag_ptr, nullptr);
+    glCompileShader(build->vert_shader_id);
+    glCompileShader(build->frag_shader_id);
+
+    // Linking goes ahead without waiting on the compile status, it just
+    // fails if a shader did
+    build->program_id = glCreateProgram();
+    glAttachShader(build->program_id, build->vert_shader_id);
+    glAttachShader(build->program_id, build->frag_shader_id);
+    if(!build->cache_path.empty())
+    {
+	glProgramParameteri(build->program_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+    glLinkProgram(build->program_id);
+    return true;
+}
+
+bool shader_build_done(const ShaderBuild *build)
+{
+    if(!build->vert_shader_id || !GLAD_GL_ARB_parallel_shader_compile)
+    {
+	return true;
+    }
+    GLint done;
+    glGetProgramiv(build->program_id, GL_COMPLETION_STATUS_ARB, &done);
+    return done;
+}
+
+bool shader_build_finish(ShaderBuild *build, GLuint *id_out)
+{
+    if(!build->vert_shader_id)
+    {
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - build->start_time).count();
+	printf("Shader '%s' ready in %.3f s, from a cached binary\n", build->fragment_file, seconds);
+	*id_out = build->program_id;
+	return true;
+    }
+    
+    GLuint program_id = build->program_id;
+    auto delete_program = deferred { glDeleteProgram(program_id); };
+    defer {
+	glDetachShader(program_id, build->vert_shader_id);
+	glDetachShader(program_id, build->frag_shader_id);
+	glDeleteShader(build->vert_shader_id);
+	glDeleteShader(build->frag_shader_id);
+    };
+    
+    GLint compile_success;
+    glGetShaderiv(build->vert_shader_id, GL_COMPILE_STATUS, &compile_success);
     if(!compile_success)
     {
-	GLint info_log_len;
-	glGetProgramiv(program_id, GL_INFO_LOG_LENGTH, &info_log_len);
+	fprintf(stderr, "Error compiling vertex shader:\n%s\n", info_log(build->vert_shader_id, false).c_str());
+	return false;
+    }
 
-	char *log_buffer = buffer;
-	auto free_buffer = maybe { free(log_buffer); }; 
-	if(info_log_len > 8192)
-	{
-	    char *log_buffer = (char*)malloc(info_log_len);
-	    free_buffer.activate();
-	}
+    glGetShaderiv(build->frag_shader_id, GL_COMPILE_STATUS, &compile_success);
+    if(!compile_success)
+    {
+	fprintf(stderr, "Error compiling fragment shader:\n%s\n", info_log(build->frag_shader_id, false).c_str());
+	return false;
+    }
 
-	glGetShaderInfoLog(program_id, info_log_len, nullptr, log_buffer);
-	
-	fprintf(stderr, "Error linking shader program:\n%s\n", log_buffer);
+    glGetProgramiv(program_id, GL_LINK_STATUS, &compile_success);
+    if(!compile_success)
+    {
+	fprintf(stderr, "Error linking shader program:\n%s\n", info_log(program_id, true).c_str());
 	return false;
     }
 
+    save_shader_program_binary(program_id, build->cache_path);
+    
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - build->start_time).count();
+    printf("Shader '%s' ready in %.3f s, built from source\n", build->fragment_file, seconds);
+
+    delete_program.deactivate();
     *id_out = program_id;
     return true;
 }
+
+bool load_shader_program(const char *vertex_file, const char *fragment_file, const char *defines, GLuint *id_out)
+{
+    ShaderBuild build;
+    return shader_build_start(vertex_file, fragment_file, defines, &build) && shader_build_finish(&build, id_out);
+}
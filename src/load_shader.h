@@ -1,6 +1,31 @@
 #ifndef __LOAD_SHADER_H__
 #define __LOAD_SHADER_H__
 
-bool load_shader_program(const char *vertex_file, const char *fragment_file, GLuint *id_out);
+#include <chrono>
+#include <string>
+
+#define SHADER_CACHE_DIR "shader_cache"
+
+// Linked programs are cached in SHADER_CACHE_DIR, keyed by the sources, the
+// driver and defines, when the driver hands out program binaries. defines
+// (may be null) go after the #version line of both shaders.
+bool load_shader_program(const char *vertex_file, const char *fragment_file, const char *defines, GLuint *id_out);
+
+// The same in steps. With ARB_parallel_shader_compile the driver compiles
+// in the background and the caller can poll for it, otherwise finishing
+// blocks until it's done.
+struct ShaderBuild
+{
+    GLuint program_id;
+    GLuint vert_shader_id, frag_shader_id;   // 0 when loaded from the cache
+    std::string cache_path;
+    const char *fragment_file;
+    std::chrono::steady_clock::time_point start_time;
+};
+
+bool shader_build_start(const char *vertex_file, const char *fragment_file, const char *defines, ShaderBuild *build);
+bool shader_build_done(const ShaderBuild *build);
+// Reports errors and cleans up after a failed build
+bool shader_build_finish(ShaderBuild *build, GLuint *id_out);
 
 #endif // __LOAD_SHADER_H__
@@ -1,6 +1,4 @@
-#include <chrono>
 #include <cstdio>
-#include <thread>
 
 #include "glad/glad.h"
 #include "glad/glad.c"
@@ -17,6 +15,8 @@
 
 #include "load_shader.h"
 #include "load_shader.cpp"
+#include "latency.h"
+#include "latency.cpp"
 
 
 static float aspect_ratio = 1.0;
@@ -28,6 +28,8 @@ static glm::vec3 mouse_pos = {0,0,1};
 static float window_width, window_height;
 static bool window_changed = false;
 
+static LatencyStats latency;
+
 void error_callback(int err, const char *desc)
 {
     fprintf(stderr, "GLFW error %i: %s\n", err, desc);
@@ -70,11 +72,16 @@ void cursor_pos_callback(GLFWwindow *window, double xpos, double ypos)
     mouse_pos.x = xpos;
     mouse_pos.y = ypos;
     mouse_moved = true;
+    if(mouse_pressed)
+    {
+	latency_input(&latency, glfwGetTime());
+    }
 }
 
 void scroll_callback(GLFWwindow *window, double x_scroll, double y_scroll)
 {
     scale -= 0.1*scale*y_scroll;
+    latency_input(&latency, glfwGetTime());
 }
 
 int main()
@@ -124,6 +131,9 @@ int main()
     //
     glfwMakeContextCurrent(window);
 
+    // Present on vblank, the loop sleeps in glfwWaitEvents between frames
+    glfwSwapInterval(1);
+
     if(!gladLoadGLLoader((GLADloadproc) glfwGetProcAddress))
     {
 	fprintf(stderr, "Unable to load OpenGL\n");
@@ -152,10 +162,13 @@ int main()
     glfwSetScrollCallback(window, scroll_callback);
     glfwSetWindowSizeCallback(window, window_size_callback);
 
+    latency_init(&latency);
+    defer { latency_report(&latency); };
+
     // Compile shaders
     //
     GLuint program_id;
-    if(!load_shader_program("shaders/simple.vert", "shaders/simple.frag", &program_id))
+    if(!load_shader_program("shaders/simple.vert", "shaders/simple.frag", nullptr, &program_id))
     {
 	return 1;
     }
@@ -199,10 +212,6 @@ int main()
     //
     while(!glfwWindowShouldClose(window))
     {
-	auto start = std::chrono::high_resolution_clock::now();
-
-	glfwPollEvents();
-
 	if(window_changed)
 	{
 	    window_matrix[0][0] = 2/window_width;
@@ -250,13 +259,13 @@ int main()
 	
 	glfwSwapBuffers(window);
 
-	auto end = std::chrono::high_resolution_clock::now();
-	auto duration = end-start;
-	auto wait_time = std::chrono::milliseconds(33) - duration;
-	if(wait_time >= std::chrono::seconds(0))
-	{
-	    std::this_thread::sleep_for(wait_time);
-	}
+	// Block until the swap is done so frames don't queue up behind vsync,
+	// which also makes this the time the frame reaches the screen
+	glFinish();
+	latency_presented(&latency, glfwGetTime());
+
+	// Every frame is redrawn, so there is nothing to do until an event arrives
+	glfwWaitEvents();
     }
     
     return 0;
@@ -1,5 +1,7 @@
-#include <chrono>
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
+#include <cstring>
 #include <thread>
 
 #ifdef __APPLE__
@@ -25,8 +27,42 @@
 #include "load_shader.cpp"
 #include "load_kernel.h"
 #include "load_kernel.cpp"
-
-#define IMAGE_SIZE 2000
+#include "cpu_render.h"
+#include "cpu_render.cpp"
+#include "tiles.h"
+#include "tiles.cpp"
+#include "tile_codec.h"
+#include "tile_codec.cpp"
+#include "tile_store.h"
+#include "tile_store.cpp"
+#include "tile_cache.h"
+#include "tile_cache.cpp"
+#include "tile_renderer.h"
+#include "tile_renderer.cpp"
+#include "prefetch.h"
+#include "prefetch.cpp"
+#include "iteration_probe.h"
+#include "iteration_probe.cpp"
+#include "mirror.h"
+#include "mirror.cpp"
+#include "cl_profile.h"
+#include "cl_profile.cpp"
+#include "cl_tuning.h"
+#include "cl_tuning.cpp"
+#include "cl_engine.h"
+#include "cl_engine.cpp"
+#include "frame_budget.h"
+#include "frame_budget.cpp"
+#include "latency.h"
+#include "latency.cpp"
+#include "iteration_field.h"
+#include "iteration_field.cpp"
+#include "palette.h"
+#include "palette.cpp"
+#include "texture_upload.h"
+#include "texture_upload.cpp"
+#include "cl_gl_upload.h"
+#include "cl_gl_upload.cpp"
 
 
 static float aspect_ratio = 1.0;
@@ -37,6 +73,110 @@ static glm::vec3 mouse_pos = {0,0,1};
 
 static float window_width, window_height;
 static bool window_changed = false;
+static int framebuffer_width, framebuffer_height;
+
+static bool do_draw = true;
+static bool do_present = true;
+
+static int max_iter = MAX_ITER;
+// Pick max_iter from a probe of each settled view, until set by hand
+static bool auto_iter = true;
+
+static LatencyStats latency;
+
+// test.cl at the current max_iter, in doubles when every device has them
+static KernelVariant cl_variant(const ClEngine &engine)
+{
+    KernelVariant variant = {max_iter, 2, FORMULA_MANDELBROT, engine.has_double ? KERNEL_DOUBLE : KERNEL_FLOAT, true, "-cl-mad-enable"};
+    return variant;
+}
+
+// Between the chunks of a deep OpenCL render: shows how far it got, and
+// gives up when there's input that needs another frame anyway
+static bool cl_chunk_done(void *user, int iter_done, int chunk_max_iter, u64 active)
+{
+    GLFWwindow *window = (GLFWwindow*)user;
+    printf("\rOpenCL: %i of %i iterations, %llu pixels iterating ", iter_done, chunk_max_iter, (unsigned long long)active);
+    fflush(stdout);
+    
+    glfwPollEvents();
+    bool cancel = glfwWindowShouldClose(window) || do_draw || (mouse_pressed && mouse_moved);
+    if(cancel || iter_done == chunk_max_iter || active == 0)
+    {
+	printf(cancel ? "cancelled\n" : "\n");
+    }
+    return !cancel;
+}
+
+// Prefetch tiles the GPU-only path renders per pass through the main loop
+#define CL_PREFETCH_GROUP 16
+
+// Prefetches stay quiet and give way to any input
+static bool cl_prefetch_chunk_done(void *user, int /*iter_done*/, int /*chunk_max_iter*/, u64 /*active*/)
+{
+    GLFWwindow *window = (GLFWwindow*)user;
+    glfwPollEvents();
+    return !(glfwWindowShouldClose(window) || do_draw || (mouse_pressed && mouse_moved));
+}
+
+// Renders the tiles under keys with OpenCL. Deep tiles render in chunks,
+// as many at once as fit the buffer, so no launch runs long and on_chunk
+// can cancel. The tiles done before a cancel or failure are kept, in the
+// order of their keys.
+static ClRenderResult cl_render_keys(ClEngine *engine, const std::vector<TileKey> &keys, ClChunkCallback on_chunk, void *user, std::vector<Tile*> *tiles)
+{
+    std::vector<RenderRegion> regions;
+    std::vector<s32*> outputs;
+    tiles->clear();
+    for(const TileKey &key : keys)
+    {
+	Tile *tile = tile_alloc_iterations();
+	tile->iter_done = key.max_iter;
+	regions.push_back(tile_region(key));
+	tiles->push_back(tile);
+	outputs.push_back(tile->iterations);
+    }
+    if(keys.empty())
+    {
+	return CL_RENDER_DONE;
+    }
+
+    ClRenderResult result = CL_RENDER_DONE;
+    size_t rendered = 0;
+    if((u64)keys[0].max_iter * TILE_SIZE*TILE_SIZE > CL_CHUNK_WORK)
+    {
+	size_t group = (size_t)IMAGE_SIZE*IMAGE_SIZE / (TILE_SIZE*TILE_SIZE);
+	while(rendered < regions.size() && result == CL_RENDER_DONE)
+	{
+	    int n = (int)std::min(regions.size() - rendered, group);
+	    result = cl_engine_render_chunked(engine, &regions[rendered], n, &outputs[rendered], on_chunk, user);
+	    rendered += result == CL_RENDER_DONE ? n : 0;
+	}
+    }
+    else if(cl_engine_render_tiles(engine, regions.data(), (int)regions.size(), outputs.data()))
+    {
+	rendered = regions.size();
+    }
+    else
+    {
+	result = CL_RENDER_FAILED;
+    }
+    for(size_t i = rendered; i < tiles->size(); ++i)
+    {
+	tile_free((*tiles)[i]);
+    }
+    tiles->resize(rendered);
+    return result;
+}
+
+// Coloring only needs another palette pass, never a new render
+static int palette_kind = PALETTE_GREY;
+static bool palette_changed = true;
+static bool cycling = false;
+
+// Write the raw iterations of the view to disk for recoloring
+static bool save_field = false;
+#define FIELD_FILENAME "view.field"
 
 void error_callback(int err, const char *desc)
 {
@@ -47,6 +187,14 @@ void framebuffer_size_callback(GLFWwindow *window, int width, int height)
 {
     aspect_ratio = (float)width / (float)height;
     glViewport(0, 0, width, height);
+    framebuffer_width = width;
+    framebuffer_height = height;
+    do_draw = true;
+}
+
+void window_refresh_callback(GLFWwindow *window)
+{
+    do_present = true;
 }
 
 void window_size_callback(GLFWwindow *window, int width, int height)
@@ -76,16 +224,92 @@ void cursor_pos_callback(GLFWwindow *window, double xpos, double ypos)
     mouse_pos.x = xpos;
     mouse_pos.y = ypos;
     mouse_moved = true;
+    if(mouse_pressed)
+    {
+	latency_input(&latency, glfwGetTime());
+    }
+}
+
+void key_callback(GLFWwindow *window, int key, int scancode, int action, int mods)
+{
+    if(action != GLFW_PRESS)
+    {
+	return;
+    }
+    if(key == GLFW_KEY_A)
+    {
+	auto_iter = !auto_iter;
+	printf("automatic max_iter %s\n", auto_iter ? "on" : "off");
+	do_draw = true;
+    }
+    else if(key == GLFW_KEY_F)
+    {
+	save_field = true;
+    }
+    else if(key == GLFW_KEY_P)
+    {
+	palette_kind = (palette_kind + 1) % PALETTE_KINDS;
+	palette_changed = true;
+	do_present = true;
+	printf("palette: %s\n", palette_name(palette_kind));
+    }
+    else if(key == GLFW_KEY_C)
+    {
+	cycling = !cycling;
+	printf("color cycling %s\n", cycling ? "on" : "off");
+    }
+    else if(key == GLFW_KEY_RIGHT_BRACKET)
+    {
+	auto_iter = false;
+	max_iter *= 2;
+	printf("max_iter: %i\n", max_iter);
+	do_draw = true;
+    }
+    else if(key == GLFW_KEY_LEFT_BRACKET && max_iter > 16)
+    {
+	auto_iter = false;
+	max_iter /= 2;
+	printf("max_iter: %i\n", max_iter);
+	do_draw = true;
+    }
 }
 
 void scroll_callback(GLFWwindow *window, double x_scroll, double y_scroll)
 {
     scale -= 0.1*scale*y_scroll;
+    do_draw = true;
+    latency_input(&latency, glfwGetTime());
 }
 
 
-int main()
+int main(int argc, char **argv)
 {
+    // --profile-cl logs per frame where the OpenCL commands spent their
+    // time, --tune-cl measures the work-group shapes of every kernel built,
+    // --sample-upload sends some frames around the PBOs to compare
+    int cl_flags = 0;
+    bool sample_upload = false;
+    for(int i = 1; i < argc; ++i)
+    {
+	if(strcmp(argv[i], "--profile-cl") == 0)
+	{
+	    cl_flags |= CL_ENGINE_PROFILE;
+	}
+	else if(strcmp(argv[i], "--tune-cl") == 0)
+	{
+	    cl_flags |= CL_ENGINE_TUNE;
+	}
+	else if(strcmp(argv[i], "--sample-upload") == 0)
+	{
+	    sample_upload = true;
+	}
+	else
+	{
+	    fprintf(stderr, "Usage: %s [--profile-cl] [--tune-cl] [--sample-upload]\n", argv[0]);
+	    return 1;
+	}
+    }
+
     // Set error callback before doing anything
     glfwSetErrorCallback(error_callback);
 
@@ -131,6 +355,9 @@ int main()
     //
     glfwMakeContextCurrent(window);
 
+    // Present on vblank, the loop sleeps in glfwWaitEvents between frames
+    glfwSwapInterval(1);
+
     if(!gladLoadGLLoader((GLADloadproc) glfwGetProcAddress))
     {
 	fprintf(stderr, "Unable to load OpenGL\n");
@@ -148,6 +375,9 @@ int main()
 	glfwGetWindowSize(window, &w_width, &w_height);
 	window_width = w_width;
 	window_height = w_height;
+
+	glfwGetFramebufferSize(window, &framebuffer_width, &framebuffer_height);
+	aspect_ratio = (float)framebuffer_width / (float)framebuffer_height;
     }
 
     
@@ -158,108 +388,91 @@ int main()
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
     glfwSetScrollCallback(window, scroll_callback);
     glfwSetWindowSizeCallback(window, window_size_callback);
+    glfwSetWindowRefreshCallback(window, window_refresh_callback);
+    glfwSetKeyCallback(window, key_callback);
 
-    // Get OpenCL platforms
-    cl_uint n_platforms;
-    cl_int ret = clGetPlatformIDs(0, nullptr, &n_platforms);
-
-    if(n_platforms == 0)
-    {
-	fprintf(stderr, "No OpenCL platforms!\n");
-	return 1;
-    }
-
-    // Use the first platform for now
-    cl_platform_id platform;
-
-    clGetPlatformIDs(1, &platform, nullptr);
+    latency_init(&latency);
+    defer { latency_report(&latency); };
 
-    // Get GPU device ids
+    // Set up OpenCL, or render on the CPU if there are no usable GPU's. The
+    // kernel builds in the background and the CPU renders until it's ready.
+    // Sharing the GL context lets OpenCL write frames into the texture.
     //
-    cl_uint n_gpus = 0;
-    ret = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 0, nullptr, &n_gpus);
-    if(ret == CL_DEVICE_NOT_FOUND)
-    {
-	fprintf(stderr, "No GPU's on the first OpenCL platform\n");
-	return 1;
-    }
-
-    cl_device_id *gpus = (cl_device_id*) malloc(sizeof(cl_device_id) * n_gpus);
-    defer { free(gpus); };
-
-    clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, n_gpus, gpus, nullptr);
-
-    // Create OpenCL context
-    cl_context context = clCreateContext(nullptr, n_gpus, gpus, nullptr, nullptr, &ret);
-    if(ret == CL_DEVICE_NOT_AVAILABLE)
+    ClEngine cl_engine;
+    cl_context_properties gl_share[CL_GL_SHARE_PROPERTIES];
+    bool share_gl = cl_gl_share_properties(window, gl_share);
+    bool cl_initialised = cl_engine_init(&cl_engine, glfwPostEmptyEvent, cl_flags, share_gl ? gl_share : nullptr);
+    if(cl_initialised && cl_engine_select(&cl_engine, cl_variant(cl_engine)) == CL_ENGINE_FAILED)
     {
-	fprintf(stderr, "GPU's are not available\n");
-	return 1;
+	cl_engine_release(&cl_engine);
+	cl_initialised = false;
     }
-    else if(ret == CL_OUT_OF_HOST_MEMORY)
+    bool cl_pending = cl_initialised;
+    bool use_cl = false;
+    u64 profile_frame = 0;
+    if(!cl_pending)
     {
-	fprintf(stderr, "OpenCL didn't have enough memory\n");
-	return 1;
+	fprintf(stderr, "Falling back to the CPU renderer\n");
     }
-    else if(ret != CL_SUCCESS)
+    defer {
+	if(cl_initialised)
+	{
+	    cl_engine_release(&cl_engine);
+	}
+    };
+
+    int n_cpu_threads = std::thread::hardware_concurrency();
+    if(n_cpu_threads < 1)
     {
-	fprintf(stderr, "Unable to create context. Error code %i\n", ret);
-	return 1;
+	n_cpu_threads = 1;
     }
 
-    defer { clReleaseContext(context); };
-
-    // Create OpenCL command queues
-    //
-    cl_command_queue *command_queues = (cl_command_queue*) malloc(n_gpus * sizeof(cl_command_queue));
-
-    for(int i = 0; i < n_gpus; ++i)
+    // Frames are built from cached tiles, only the missing ones get rendered.
+    // Finished tiles are kept on disk for the next session. The cache is
+    // declared first so it outlives the store's writer, which still frees
+    // tiles sharing the cache's contents.
+    TileCache tile_cache;
+    TileStore tile_store;
+    bool use_store = tile_store_open(&tile_store, "tile_store", TILE_STORE_DEFAULT_QUOTA);
+    if(!use_store)
     {
-	command_queues[i] = clCreateCommandQueue(context, gpus[i], CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &ret);
-	
-	if(ret == CL_INVALID_QUEUE_PROPERTIES)
-	{
-	    command_queues[i] = clCreateCommandQueue(context, gpus[i], 0, &ret);
-	}
-	if(ret == CL_OUT_OF_HOST_MEMORY)
-	{
-	    fprintf(stderr, "OpenCL ran out of memory\n");
-	}
-	else if(ret != CL_SUCCESS)
-	{
-	    fprintf(stderr, "Unable to create command queues. Error code %i\n", ret);
-	}
-	if(ret != CL_SUCCESS)
-	{
-	    for(int j = 0; j < i; ++j)
-	    {
-		clReleaseCommandQueue(command_queues[j]);
-	    }
-	    free(command_queues);
-	    return 1;
-	}
+	fprintf(stderr, "Tiles won't be kept between sessions\n");
     }
-
     defer {
-	for(int i = 0; i < n_gpus; ++i)
+	if(use_store)
 	{
-	    clReleaseCommandQueue(command_queues[i]);
+	    tile_store_close(&tile_store);
 	}
-	free(command_queues);
     };
 
-    // Load OpenCL kernel
-    cl_kernel kernel;
-    if(!load_kernel(context, n_gpus, gpus, "gpu_programs/test.cl", "test_kernel", kernel))
-    {
-	return 1;
-    }
-
-    GLuint program_id;
-    if(!load_shader_program("gpu_programs/picture.vert", "gpu_programs/picture.frag", &program_id))
+    tile_cache_init(&tile_cache, TILE_CACHE_DEFAULT_BUDGET, use_store ? &tile_store : nullptr);
+    defer { tile_cache_release(&tile_cache); };
+    defer {
+	std::lock_guard<std::mutex> guard(tile_cache.lock);
+	tile_cache_report(&tile_cache);
+    };
+    std::vector<TileKey> missing_tiles;
+    // Missing tiles for the GPU-only path, rendered in one pipeline
+    std::vector<Tile*> cl_tiles;
+    // Where the view is heading, rendered a group at a time while idle.
+    // The most wanted come last.
+    std::vector<TileKey> cl_prefetch;
+
+    // The CPU renderer fills them from a worker pool so idle workers can
+    // prefetch. It's started either way, OpenCL takes over once it's built.
+    TileRenderer tile_renderer;
+    // Keep unresolved pixels around so raising max_iter resumes them
+    tile_renderer.keep_state = true;
+    tile_renderer_start(&tile_renderer, &tile_cache, n_cpu_threads, glfwPostEmptyEvent);
+    defer { tile_renderer_stop(&tile_renderer); };
+
+    // Frames are colored on the CPU until the shader is linked
+    ShaderBuild picture_build;
+    if(!shader_build_start("gpu_programs/picture.vert", "gpu_programs/picture.frag", nullptr, &picture_build))
     {
 	return 1;
     }
+    GLuint program_id = 0;
 
     // Setup rendering data
     //
@@ -283,117 +496,458 @@ int main()
 
 
     
-    // TODO from here down is incomplete
-
-    
-    cl_image_format img_format = {CL_RGBA, CL_UNORM_INT8};
-    cl_image_desc img_desc = {
-	CL_MEM_OBJECT_IMAGE2D,
-	IMAGE_SIZE,
-	IMAGE_SIZE,
-	1,
-	1,
-	0,
-	0,
-	0,
-	0,
-	nullptr
+    // Frames go to OpenGL as iterations, picture.frag colors them through
+    // the palette. Integer textures can't be filtered, the shader blends
+    // the colors itself.
+    GLuint iteration_texture;
+    glGenTextures(1, &iteration_texture);
+    glBindTexture(GL_TEXTURE_2D, iteration_texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    TextureUpload iteration_upload;
+    texture_upload_init(&iteration_upload, sample_upload);
+    defer {
+	texture_upload_report(&iteration_upload);
+	texture_upload_release(&iteration_upload);
     };
-    
-    cl_mem memory = clCreateImage(context, CL_MEM_WRITE_ONLY, &img_format, &img_desc, nullptr, &ret);
-    if(ret != CL_SUCCESS)
+
+    // The upload keeps the context alive, so it outlives a failed engine
+    ClGlUpload cl_gl_upload;
+    if(cl_initialised && cl_gl_upload_init(&cl_gl_upload, &cl_engine))
     {
-	fprintf(stderr, "Unable to create OpenCL image\n");
-	return 1;
+	texture_upload_set_path(&iteration_upload, cl_gl_upload_iterations, &cl_gl_upload, "CL/GL sharing");
+	printf("Frames go into the texture through CL/GL sharing\n");
     }
-    defer { clReleaseMemObject(memory); };
-
-    float step = 4.0f / ((float)IMAGE_SIZE);
+    defer { cl_gl_upload_release(&cl_gl_upload); };
+
+    GLuint palette_texture;
+    glGenTextures(1, &palette_texture);
+    glBindTexture(GL_TEXTURE_1D, palette_texture);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    u32 palette[PALETTE_SIZE];
+    float palette_offset = 0;
+
+    // Until the shader is linked, frames are colored on the CPU and blitted
+    GLuint color_texture;
+    glGenTextures(1, &color_texture);
     
-    cl_float2 origin = {-2,-2};
-    cl_float2 dx = {step, 0};
-    cl_float2 dy = {0, step};
+    GLuint present_fbo;
+    glGenFramebuffers(1, &present_fbo);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, present_fbo);
+    glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color_texture, 0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+    std::vector<s32> frame_iterations;
+    std::vector<u32> frame_colors;
+    int frame_width = 0;
+    int frame_height = 0;
+    int frame_max_iter = max_iter;
+    bool frame_uploaded = false;
+    double present_time = glfwGetTime();
+
+    glm::mat3 view_matrix = {2, 0, 0,
+			     0, 2, 0,
+			     0, 0, 1};
     
-    clSetKernelArg(kernel, 0, sizeof(cl_float2), &origin);
-    clSetKernelArg(kernel, 1, sizeof(cl_float2), &dx);
-    clSetKernelArg(kernel, 2, sizeof(cl_float2), &dy);
-	    
-    ret = clSetKernelArg(kernel, 3, sizeof(cl_mem), (void*)&memory);
-    if(ret != CL_SUCCESS)
-    {
-	fprintf(stderr, "Unable to set kernel argument\n");
-	return 1;
-    }
-
-    printf("Enqueuing task\n");
+    glm::mat3 window_matrix = {2/window_width, 0, 0,
+			       0, -2/window_height, 0,
+			       -1, 1, 1};
     
-    for(int i = 0; i < n_gpus; ++i)
+    float center_x = 0;
+    float center_y = 0;
+
+    glm::vec3 prev_mouse_pos = mouse_pos;
+
+    FrameBudget budget;
+    frame_budget_init(&budget, 60);
+
+    bool probe_pending = true;
+
+    ViewMotion motion;
+    view_motion_init(&motion, glfwGetTime());
+    float drawn_center_x = center_x;
+    float drawn_center_y = center_y;
+    float drawn_scale = scale;
+
+    while(!glfwWindowShouldClose(window))
     {
-	const static size_t work_sizes[] = {IMAGE_SIZE, IMAGE_SIZE};
-	ret = clEnqueueNDRangeKernel(command_queues[i], kernel, 2, nullptr, work_sizes, nullptr, 0, nullptr, nullptr);
-	if(ret != CL_SUCCESS)
+	// Sleep until there is input, or until the full resolution pass or
+	// the probe is due
+	double wait_time = frame_budget_wait_time(&budget, glfwGetTime());
+	if(auto_iter && probe_pending)
 	{
-	    fprintf(stderr, "Unable to enqueue task\n");
-	    return 1;
+	    wait_time = frame_budget_idle_wait(&budget, glfwGetTime());
+	}
+	if(do_draw || cycling || (use_cl && !cl_prefetch.empty()))
+	{
+	    glfwPollEvents();
+	}
+	else if(wait_time >= 0)
+	{
+	    glfwWaitEventsTimeout(wait_time);
+	}
+	else
+	{
+	    glfwWaitEvents();
 	}
-    }
 
-    int *buffer = (int*) malloc(IMAGE_SIZE*IMAGE_SIZE*sizeof(int));
+	if(window_changed)
+	{
+	    window_matrix[0][0] = 2/window_width;
+	    window_matrix[1][1] = -2/window_height;
+	    
+	    window_changed = false;
+	}
 
-    printf("Enqueuing read\n");
-    
-    for(int i = 0; i < n_gpus; ++i)
-    {
-	const static size_t read_origin[] = {0,0,0};
-	const static size_t read_region[] = {IMAGE_SIZE,IMAGE_SIZE,1};
-	ret = clEnqueueReadImage(command_queues[i], memory, CL_TRUE, read_origin, read_region, 0, 0, buffer, 0, nullptr, nullptr);
-	if(ret != CL_SUCCESS)
+	if(cl_pending)
 	{
-	    fprintf(stderr, "Unable to read buffer\n");
-	    return 1;
+	    ClEngineState state = cl_engine_update(&cl_engine);
+	    if(state == CL_ENGINE_READY && cl_engine.has_double)
+	    {
+		// In doubles the devices' tiles pass for the CPU's, so they
+		// take tiles from the same queue as the CPU workers and the
+		// frame uses every core as well
+		cl_pending = false;
+		tile_renderer_add_cl(&tile_renderer, &cl_engine, cl_variant(cl_engine));
+		do_draw = true;
+		printf("OpenCL devices joined the CPU workers\n");
+	    }
+	    else if(state == CL_ENGINE_READY)
+	    {
+		cl_pending = false;
+		use_cl = true;
+		do_draw = true;
+		printf("Switched to OpenCL\n");
+	    }
+	    else if(state == CL_ENGINE_FAILED)
+	    {
+		cl_pending = false;
+		cl_initialised = false;
+		cl_engine_release(&cl_engine);
+		fprintf(stderr, "Falling back to the CPU renderer\n");
+	    }
 	}
-    }
 
-    GLuint texture_id;
-    glGenTextures(1, &texture_id);
-    glBindTexture(GL_TEXTURE_2D, texture_id);
+	if(!program_id && shader_build_done(&picture_build))
+	{
+	    if(!shader_build_finish(&picture_build, &program_id))
+	    {
+		return 1;
+	    }
+	    glUseProgram(program_id);
+	    glUniform1i(glGetUniformLocation(program_id, "iteration_sampler"), 0);
+	    glUniform1i(glGetUniformLocation(program_id, "palette_sampler"), 1);
+	    frame_uploaded = false;
+	    do_present = true;
+	}
 
-    // Give the image to OpenGL
-    glTexImage2D(GL_TEXTURE_2D, 0,GL_RGB, IMAGE_SIZE, IMAGE_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, buffer);
+	if(mouse_moved)
+	{
+	    if(mouse_pressed)
+	    {
+		glm::vec3 prev = view_matrix * (window_matrix * prev_mouse_pos);
+		glm::vec3 current = view_matrix * (window_matrix * mouse_pos);
 
-    free(buffer);
+		glm::vec3 dp = current - prev;
+		center_x -= dp.x;
+		center_y -= dp.y;
+		do_draw = true;
+	    }
+	    prev_mouse_pos = mouse_pos;
+	    mouse_moved = false;
+	}
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	float half_h = 2*scale;
+	float half_w = aspect_ratio * half_h;
+	view_matrix[0][0] = half_w;
+	view_matrix[2][0] = center_x;
+	view_matrix[1][1] = half_h;
+	view_matrix[2][1] = center_y;
 
-    while(!glfwWindowShouldClose(window))
-    {
-	auto start = std::chrono::high_resolution_clock::now();
+	if(save_field)
+	{
+	    // Always at full resolution and in double precision, whatever the
+	    // screen is showing
+	    save_field = false;
+	    RenderRegion region;
+	    region.width = framebuffer_width;
+	    region.height = framebuffer_height;
+	    region.step = 2*half_h / region.height;
+	    region.origin_x = center_x - 0.5*region.step*region.width;
+	    region.origin_y = center_y - half_h;
+
+	    IterationField field;
+	    iteration_field_render(region, max_iter, n_cpu_threads, &field);
+	    defer { iteration_field_free(&field); };
+	    if(iteration_field_save(field, FIELD_FILENAME))
+	    {
+		printf("Saved the iteration field of the view to '%s'\n", FIELD_FILENAME);
+	    }
+	}
 
-	glfwPollEvents();
+	// Probe only once the view settles, during a drag the last cap is
+	// good enough and the probe would eat into the frame budget
+	bool probe_changed = false;
+	if(auto_iter && probe_pending && !do_draw && frame_budget_idle(&budget, glfwGetTime()))
+	{
+	    probe_pending = false;
+	    RenderRegion region;
+	    region.width = framebuffer_width;
+	    region.height = framebuffer_height;
+	    region.step = 2*half_h / region.height;
+	    region.origin_x = center_x - 0.5*region.step*region.width;
+	    region.origin_y = center_y - half_h;
+
+	    ProbeResult probe = probe_max_iter(region, 32, 1 << 14, 0.005);
+	    if(probe.max_iter != max_iter)
+	    {
+		max_iter = probe.max_iter;
+		probe_changed = true;
+		printf("max_iter: %i (%.1f%% unresolved, %.1f%% interior)\n", max_iter,
+		       100 * probe.unresolved_fraction, 100 * probe.interior_fraction);
+	    }
+	}
+
+	float res_scale = 1;
+	bool draw_now = false;
+	if(do_draw)
+	{
+	    do_draw = false;
+	    draw_now = true;
+	    probe_pending = true;
+	    frame_budget_input(&budget, glfwGetTime());
+	    res_scale = frame_budget_scale(&budget, framebuffer_width, framebuffer_height);
+	}
+	else if(frame_budget_refine_due(&budget, glfwGetTime()))
+	{
+	    draw_now = true;
+	}
+	else if(probe_changed)
+	{
+	    // The settled view needs a different cap, redraw at the
+	    // resolution already in use
+	    draw_now = true;
+	    res_scale = budget.last_scale;
+	}
+	else if(!use_cl && tile_renderer_take_refined(&tile_renderer))
+	{
+	    // Deeper iterations landed for tiles on screen, show them at the
+	    // resolution already in use
+	    draw_now = true;
+	    res_scale = budget.last_scale;
+	}
+
+	if(draw_now)
+	{
+	    // The OpenCL image caps the resolution, keep the aspect ratio when it does
+	    int largest = framebuffer_width > framebuffer_height ? framebuffer_width : framebuffer_height;
+	    float fit_scale = res_scale;
+	    if(largest * fit_scale > IMAGE_SIZE)
+	    {
+		fit_scale = (float)IMAGE_SIZE / (float)largest;
+	    }
+	    
+	    RenderRegion region;
+	    scaled_size(fit_scale, framebuffer_width, framebuffer_height, &region.width, &region.height);
+	    region.step = 2*half_h / region.height;
+	    region.origin_x = center_x - 0.5*region.step*region.width;
+	    region.origin_y = center_y - half_h;
+
+	    double render_start = glfwGetTime();
+
+	    view_motion_update(&motion, center_x - drawn_center_x, center_y - drawn_center_y,
+			       std::log(scale / drawn_scale), render_start);
+	    drawn_center_x = center_x;
+	    drawn_center_y = center_y;
+	    drawn_scale = scale;
+	    
+	    frame_iterations.resize((size_t)region.width*region.height);
+	    s32 *buffer = frame_iterations.data();
 
-	glClear(GL_COLOR_BUFFER_BIT);
+	    int level = tile_level_for_step(region.step);
 
-	glUseProgram(program_id);
+	    if(use_cl)
+	    {
+		// Variants used before switch right away, a new one builds its
+		// kernel while the CPU renders. A new max_iter is only an
+		// argument.
+		ClEngineState state = cl_engine_select(&cl_engine, cl_variant(cl_engine));
+		if(state == CL_ENGINE_BUILDING)
+		{
+		    use_cl = false;
+		    cl_pending = true;
+		}
+		else if(state == CL_ENGINE_FAILED)
+		{
+		    use_cl = false;
+		    cl_initialised = false;
+		    cl_engine_release(&cl_engine);
+		    fprintf(stderr, "Falling back to the CPU renderer\n");
+		}
+	    }
+	    
+	    if(use_cl)
+	    {
+		s32 cl_precision = cl_engine.has_double ? TILE_CL_DOUBLE : TILE_CL_FLOAT;
+		cl_prefetch.clear();
+		{
+		    std::lock_guard<std::mutex> guard(tile_cache.lock);
+		    tile_cache_missing(&tile_cache, region, level, max_iter, cl_precision, &missing_tiles);
+		}
+		// The frame waits for its tiles, only the tile workers' batches
+		// run alongside the host. The cache stays unlocked meanwhile,
+		// chunked renders pump events from in there.
+		ClRenderResult result = cl_render_keys(&cl_engine, missing_tiles, cl_chunk_done, window, &cl_tiles);
+
+		std::lock_guard<std::mutex> guard(tile_cache.lock);
+		for(size_t i = 0; i < cl_tiles.size(); ++i)
+		{
+		    tile_cache_insert(&tile_cache, missing_tiles[i], cl_tiles[i]);
+		}
+		if(result == CL_RENDER_FAILED)
+		{
+		    return 1;
+		}
+		if(result == CL_RENDER_CANCELLED)
+		{
+		    // The input that cancelled it asks for the next frame
+		    continue;
+		}
+		tile_cache_compose(&tile_cache, region, level, max_iter, cl_precision, buffer);
+		tile_cache_trim(&tile_cache);
+
+		// The visible tiles are done, queue the ones the view is heading for
+		prefetch_keys(region, level, max_iter, cl_precision, motion, render_start, &cl_prefetch);
+		std::reverse(cl_prefetch.begin(), cl_prefetch.end());
+	    }
+	    else
+	    {
+		tile_renderer_render(&tile_renderer, region, level, max_iter, buffer);
+		prefetch_tiles(&tile_renderer, region, level, max_iter, motion, render_start);
 
-	glEnableVertexAttribArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+		std::lock_guard<std::mutex> guard(tile_cache.lock);
+		tile_cache_trim(&tile_cache);
+	    }
 
-	glDrawArrays(GL_TRIANGLES, 0, 6);
+	    frame_width = region.width;
+	    frame_height = region.height;
+	    frame_max_iter = max_iter;
+	    frame_uploaded = false;
 
-	glDisableVertexAttribArray(0);
-	
-	glfwSwapBuffers(window);
+	    frame_budget_record(&budget, res_scale, region.width, region.height, glfwGetTime() - render_start);
+	}
+	else if(use_cl && !cl_prefetch.empty())
+	{
+	    // A group per pass through the loop, so input gets handled in
+	    // between, and any input cancels a chunked group
+	    missing_tiles.clear();
+	    {
+		std::lock_guard<std::mutex> guard(tile_cache.lock);
+		while(!cl_prefetch.empty() && missing_tiles.size() < CL_PREFETCH_GROUP)
+		{
+		    TileKey key = cl_prefetch.back();
+		    cl_prefetch.pop_back();
+		    if(!tile_cache_find(&tile_cache, key) &&
+		       std::find(missing_tiles.begin(), missing_tiles.end(), key) == missing_tiles.end())
+		    {
+			missing_tiles.push_back(key);
+		    }
+		}
+	    }
+	    ClRenderResult result = cl_render_keys(&cl_engine, missing_tiles, cl_prefetch_chunk_done, window, &cl_tiles);
+
+	    std::lock_guard<std::mutex> guard(tile_cache.lock);
+	    for(size_t i = 0; i < cl_tiles.size(); ++i)
+	    {
+		tile_cache_insert(&tile_cache, missing_tiles[i], cl_tiles[i]);
+	    }
+	    tile_cache_trim(&tile_cache);
+	    if(result == CL_RENDER_FAILED)
+	    {
+		return 1;
+	    }
+	    if(result == CL_RENDER_CANCELLED)
+	    {
+		cl_prefetch.clear();
+	    }
+	}
 
-	auto end = std::chrono::high_resolution_clock::now();
-	auto duration = end-start;
-	auto wait_time = std::chrono::milliseconds(33) - duration;
-	if(wait_time >= std::chrono::seconds(0))
+	if(draw_now || do_present || cycling)
 	{
-	    std::this_thread::sleep_for(wait_time);
+	    do_present = false;
+
+	    double now = glfwGetTime();
+	    if(cycling)
+	    {
+		palette_offset += PALETTE_CYCLE_SPEED * (now - present_time);
+		palette_offset -= std::floor(palette_offset);
+	    }
+	    present_time = now;
+	    
+	    if(palette_changed)
+	    {
+		palette_changed = false;
+		palette_fill(palette_kind, palette);
+		glBindTexture(GL_TEXTURE_1D, palette_texture);
+		glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA8, PALETTE_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, palette);
+	    }
+	    
+	    glClear(GL_COLOR_BUFFER_BIT);
+
+	    if(program_id && frame_width > 0)
+	    {
+		if(!frame_uploaded)
+		{
+		    frame_uploaded = true;
+		    texture_upload_iterations(&iteration_upload, iteration_texture, frame_width, frame_height, frame_iterations.data());
+		}
+		
+		glUseProgram(program_id);
+		glUniform1i(glGetUniformLocation(program_id, "max_iter"), frame_max_iter);
+		glUniform1f(glGetUniformLocation(program_id, "palette_offset"), palette_offset);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, iteration_texture);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_1D, palette_texture);
+		glActiveTexture(GL_TEXTURE0);
+
+		glEnableVertexAttribArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+
+		glDrawArrays(GL_TRIANGLES, 0, 6);
+
+		glDisableVertexAttribArray(0);
+	    }
+	    else if(frame_width > 0)
+	    {
+		frame_colors.resize(frame_iterations.size());
+		palette_colorize(palette, frame_iterations.data(), frame_iterations.size(), frame_max_iter, palette_offset, frame_colors.data());
+		glBindTexture(GL_TEXTURE_2D, color_texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, frame_width, frame_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, frame_colors.data());
+		
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, present_fbo);
+		glBlitFramebuffer(0, 0, frame_width, frame_height,
+				  0, 0, framebuffer_width, framebuffer_height,
+				  GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	    }
+	
+	    glfwSwapBuffers(window);
+
+	    // Block until the swap is done so frames don't queue up behind vsync,
+	    // which also makes this the time the frame reaches the screen
+	    glFinish();
+	    latency_presented(&latency, glfwGetTime());
+
+	    if(cl_initialised && cl_engine.profile)
+	    {
+		cl_profile_summary(cl_engine.profile, profile_frame++);
+	    }
 	}
     }
     
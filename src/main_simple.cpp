@@ -1,6 +1,6 @@
-#include <chrono>
+#include <cmath>
 #include <cstdio>
-#include <thread>
+#include <vector>
 
 #include "glad/glad.h"
 #include "glad/glad.c"
@@ -17,6 +17,26 @@
 
 #include "load_shader.h"
 #include "load_shader.cpp"
+#include "frame_budget.h"
+#include "frame_budget.cpp"
+#include "latency.h"
+#include "latency.cpp"
+#include "mirror.h"
+#include "mirror.cpp"
+#include "cpu_render.h"
+#include "cpu_render.cpp"
+#include "tiles.h"
+#include "tiles.cpp"
+#include "tile_codec.h"
+#include "tile_codec.cpp"
+#include "tile_store.h"
+#include "tile_store.cpp"
+#include "tile_cache.h"
+#include "tile_cache.cpp"
+#include "palette.h"
+#include "palette.cpp"
+#include "texture_upload.h"
+#include "texture_upload.cpp"
 
 
 static float aspect_ratio = 1.0;
@@ -27,9 +47,20 @@ static glm::vec3 mouse_pos = {0,0,1};
 
 static float window_width, window_height;
 static bool window_changed = false;
+static int framebuffer_width, framebuffer_height;
 
 static bool do_draw = true;
 
+// Build frames from cached tiles, shading only the ones not seen before
+static bool tiled = false;
+
+// simple.frag shades iterations, picture.frag colors them
+static int palette_kind = PALETTE_GREY;
+static bool palette_changed = true;
+static bool cycling = false;
+
+static LatencyStats latency;
+
 void error_callback(int err, const char *desc)
 {
     fprintf(stderr, "GLFW error %i: %s\n", err, desc);
@@ -38,7 +69,13 @@ void error_callback(int err, const char *desc)
 void framebuffer_size_callback(GLFWwindow *window, int width, int height)
 {
     aspect_ratio = (float)width / (float)height;
-    glViewport(0, 0, width, height);
+    framebuffer_width = width;
+    framebuffer_height = height;
+    do_draw = true;
+}
+
+void window_refresh_callback(GLFWwindow *window)
+{
     do_draw = true;
 }
 
@@ -73,12 +110,38 @@ void cursor_pos_callback(GLFWwindow *window, double xpos, double ypos)
     mouse_pos.x = xpos;
     mouse_pos.y = ypos;
     mouse_moved = true;
+    if(mouse_pressed)
+    {
+	latency_input(&latency, glfwGetTime());
+    }
 }
 
 void scroll_callback(GLFWwindow *window, double x_scroll, double y_scroll)
 {
     scale -= 0.1*scale*y_scroll;
     do_draw = true;
+    latency_input(&latency, glfwGetTime());
+}
+
+void key_callback(GLFWwindow *window, int key, int scancode, int action, int mods)
+{
+    if(key == GLFW_KEY_T && action == GLFW_PRESS)
+    {
+	tiled = !tiled;
+	printf("tiled rendering %s\n", tiled ? "on" : "off");
+	do_draw = true;
+    }
+    else if(key == GLFW_KEY_P && action == GLFW_PRESS)
+    {
+	palette_kind = (palette_kind + 1) % PALETTE_KINDS;
+	palette_changed = true;
+	printf("palette: %s\n", palette_name(palette_kind));
+    }
+    else if(key == GLFW_KEY_C && action == GLFW_PRESS)
+    {
+	cycling = !cycling;
+	printf("color cycling %s\n", cycling ? "on" : "off");
+    }
 }
 
 int main()
@@ -128,6 +191,9 @@ int main()
     //
     glfwMakeContextCurrent(window);
 
+    // Present on vblank, the loop sleeps in glfwWaitEvents between frames
+    glfwSwapInterval(1);
+
     if(!gladLoadGLLoader((GLADloadproc) glfwGetProcAddress))
     {
 	fprintf(stderr, "Unable to load OpenGL\n");
@@ -145,6 +211,9 @@ int main()
 	glfwGetWindowSize(window, &w_width, &w_height);
 	window_width = w_width;
 	window_height = w_height;
+
+	glfwGetFramebufferSize(window, &framebuffer_width, &framebuffer_height);
+	aspect_ratio = (float)framebuffer_width / (float)framebuffer_height;
     }
 
     
@@ -155,11 +224,16 @@ int main()
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
     glfwSetScrollCallback(window, scroll_callback);
     glfwSetWindowSizeCallback(window, window_size_callback);
+    glfwSetWindowRefreshCallback(window, window_refresh_callback);
+    glfwSetKeyCallback(window, key_callback);
+
+    latency_init(&latency);
+    defer { latency_report(&latency); };
 
     // Compile shaders
     //
     GLuint program_id;
-    if(!load_shader_program("gpu_programs/simple.vert", "gpu_programs/simple.frag", &program_id))
+    if(!load_shader_program("gpu_programs/simple.vert", "gpu_programs/simple.frag", nullptr, &program_id))
     {
 	return 1;
     }
@@ -185,6 +259,28 @@ int main()
     glBufferData(GL_ARRAY_BUFFER, sizeof(vertex_data), vertex_data, GL_STATIC_DRAW);
 
     GLint matrix_id = glGetUniformLocation(program_id, "view_matrix");
+
+    GLuint picture_program_id;
+    if(!load_shader_program("gpu_programs/picture.vert", "gpu_programs/picture.frag", nullptr, &picture_program_id))
+    {
+	return 1;
+    }
+    glUseProgram(picture_program_id);
+    glUniform1i(glGetUniformLocation(picture_program_id, "iteration_sampler"), 0);
+    glUniform1i(glGetUniformLocation(picture_program_id, "palette_sampler"), 1);
+    // simple.frag always stops at MAX_ITER
+    glUniform1i(glGetUniformLocation(picture_program_id, "max_iter"), MAX_ITER);
+    GLint palette_offset_id = glGetUniformLocation(picture_program_id, "palette_offset");
+
+    GLuint palette_texture;
+    glGenTextures(1, &palette_texture);
+    defer { glDeleteTextures(1, &palette_texture); };
+    glBindTexture(GL_TEXTURE_1D, palette_texture);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    float palette_offset = 0;
+    double present_time = glfwGetTime();
     
     glm::mat3 view_matrix = {2, 0, 0,
 			     0, 2, 0,
@@ -198,14 +294,102 @@ int main()
     float center_y = 0;
 
     glm::vec3 prev_mouse_pos = mouse_pos;
+
+    // Offscreen target the fractal is shaded into as iterations, at the
+    // resolution the frame budget allows
+    //
+    GLuint offscreen_fbo, offscreen_texture;
+    glGenFramebuffers(1, &offscreen_fbo);
+    glGenTextures(1, &offscreen_texture);
+    defer {
+	glDeleteFramebuffers(1, &offscreen_fbo);
+	glDeleteTextures(1, &offscreen_texture);
+    };
+    int offscreen_width = 0, offscreen_height = 0;
+
+    // Tiles are shaded one at a time into tile_fbo and read back into the
+    // cache, then frames are composed on the CPU and shown from frame_texture.
+    // Finished tiles are kept on disk for the next session. The cache is
+    // declared first so it outlives the store's writer, which still frees
+    // tiles sharing the cache's contents.
+    //
+    TileCache tile_cache;
+    TileStore tile_store;
+    bool use_store = tile_store_open(&tile_store, "tile_store", TILE_STORE_DEFAULT_QUOTA);
+    if(!use_store)
+    {
+	fprintf(stderr, "Tiles won't be kept between sessions\n");
+    }
+    defer {
+	if(use_store)
+	{
+	    tile_store_close(&tile_store);
+	}
+    };
+
+    tile_cache_init(&tile_cache, TILE_CACHE_DEFAULT_BUDGET, use_store ? &tile_store : nullptr);
+    defer { tile_cache_release(&tile_cache); };
+    defer {
+	std::lock_guard<std::mutex> guard(tile_cache.lock);
+	tile_cache_report(&tile_cache);
+    };
+    std::vector<TileKey> missing_tiles;
+    std::vector<s32> frame_iterations;
+
+    GLuint tile_fbo, tile_texture, frame_texture;
+    glGenFramebuffers(1, &tile_fbo);
+    glGenTextures(1, &tile_texture);
+    glGenTextures(1, &frame_texture);
+    defer {
+	glDeleteFramebuffers(1, &tile_fbo);
+	glDeleteTextures(1, &tile_texture);
+	glDeleteTextures(1, &frame_texture);
+    };
+    
+    glBindTexture(GL_TEXTURE_2D, tile_texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32I, TILE_SIZE, TILE_SIZE, 0, GL_RED_INTEGER, GL_INT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, tile_fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tile_texture, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    glBindTexture(GL_TEXTURE_2D, frame_texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    TextureUpload frame_upload;
+    texture_upload_init(&frame_upload, false);
+    defer {
+	texture_upload_report(&frame_upload);
+	texture_upload_release(&frame_upload);
+    };
+
+    // The iterations the palette pass colors, either frame
+    GLuint shown_texture = offscreen_texture;
+
+    FrameBudget budget;
+    frame_budget_init(&budget, 60);
     
     // Main loop!
     //
     while(!glfwWindowShouldClose(window))
     {
-	auto start = std::chrono::high_resolution_clock::now();
-
-	glfwPollEvents();
+	// Sleep until there is input, or until the full resolution pass is due
+	double wait_time = frame_budget_wait_time(&budget, glfwGetTime());
+	if(do_draw || cycling)
+	{
+	    glfwPollEvents();
+	}
+	else if(wait_time >= 0)
+	{
+	    glfwWaitEventsTimeout(wait_time);
+	}
+	else
+	{
+	    glfwWaitEvents();
+	}
 
 	if(window_changed)
 	{
@@ -231,9 +415,24 @@ int main()
 	    mouse_moved = false;
 	}
 
+	float res_scale = 1;
+	bool draw_now = false;
 	if(do_draw)
 	{
 	    do_draw = false;
+	    draw_now = true;
+	    frame_budget_input(&budget, glfwGetTime());
+	    res_scale = frame_budget_scale(&budget, framebuffer_width, framebuffer_height);
+	}
+	else if(frame_budget_refine_due(&budget, glfwGetTime()))
+	{
+	    draw_now = true;
+	}
+
+	if(draw_now)
+	{
+	    int render_width, render_height;
+	    scaled_size(res_scale, framebuffer_width, framebuffer_height, &render_width, &render_height);
 	    
 	    float half_h = 2*scale;
 	    float half_w = aspect_ratio * half_h;
@@ -242,30 +441,174 @@ int main()
 	    view_matrix[1][1] = half_h;
 	    view_matrix[2][1] = center_y;
 
+	    if(tiled)
+	    {
+		RenderRegion region;
+		region.width = render_width;
+		region.height = render_height;
+		region.step = 2*half_h / render_height;
+		region.origin_x = center_x - 0.5*region.step*region.width;
+		region.origin_y = center_y - half_h;
+
+		double render_start = glfwGetTime();
+
+		// simple.frag always stops at MAX_ITER
+		int level = tile_level_for_step(region.step);
+		tile_cache_missing(&tile_cache, region, level, MAX_ITER, TILE_GLSL_FLOAT, &missing_tiles);
+		if(!missing_tiles.empty())
+		{
+		    glBindFramebuffer(GL_FRAMEBUFFER, tile_fbo);
+		    glViewport(0, 0, TILE_SIZE, TILE_SIZE);
+		    glUseProgram(program_id);
+		    glEnableVertexAttribArray(0);
+		    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+		    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+		    
+		    for(const TileKey &key : missing_tiles)
+		    {
+			// Fragment centers land on the tile's sample points
+			float span = TILE_SIZE * tile_step(key.level);
+			glm::mat3 tile_matrix = {span/2, 0, 0,
+						 0, span/2, 0,
+						 (key.x + 0.5f)*span, (key.y + 0.5f)*span, 1};
+			glUniformMatrix3fv(matrix_id, 1, GL_FALSE, glm::value_ptr(tile_matrix));
+			glDrawArrays(GL_TRIANGLES, 0, 6);
+
+			Tile *tile = tile_alloc_iterations();
+			glReadPixels(0, 0, TILE_SIZE, TILE_SIZE, GL_RED_INTEGER, GL_INT, tile->iterations);
+			tile->iter_done = key.max_iter;
+			tile_cache_insert(&tile_cache, key, tile);
+		    }
+		    
+		    glDisableVertexAttribArray(0);
+		    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		}
+
+		frame_iterations.resize((size_t)render_width * render_height);
+		tile_cache_compose(&tile_cache, region, level, MAX_ITER, TILE_GLSL_FLOAT, frame_iterations.data());
+		tile_cache_trim(&tile_cache);
+
+		texture_upload_iterations(&frame_upload, frame_texture, render_width, render_height, frame_iterations.data());
+		frame_budget_record(&budget, res_scale, render_width, render_height, glfwGetTime() - render_start);
+		shown_texture = frame_texture;
+	    }
+	    else
+	    {
+		if(render_width != offscreen_width || render_height != offscreen_height)
+		{
+		    glBindTexture(GL_TEXTURE_2D, offscreen_texture);
+		    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32I, render_width, render_height, 0, GL_RED_INTEGER, GL_INT, nullptr);
+		    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+
+		    glBindFramebuffer(GL_FRAMEBUFFER, offscreen_fbo);
+		    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, offscreen_texture, 0);
+		    
+		    offscreen_width = render_width;
+		    offscreen_height = render_height;
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, offscreen_fbo);
+		glViewport(0, 0, render_width, render_height);
+
+		// If the view straddles the real axis, shade one side and copy it
+		// flipped to the other. Fragments are sampled at pixel centers.
+		double bottom = center_y - half_h;
+		MirrorSplit split;
+		bool mirrored = mirror_split(&bottom, 2*half_h / render_height, render_height, 0.5, &split);
+		if(mirrored)
+		{
+		    view_matrix[2][1] = bottom + half_h;
+		}
+
+		double render_start = glfwGetTime();
+
+		const GLint unresolved[] = {-1, 0, 0, 0};
+		glClearBufferiv(GL_COLOR, 0, unresolved);
+
+		if(mirrored)
+		{
+		    glEnable(GL_SCISSOR_TEST);
+		    glScissor(0, split.compute_row, render_width, split.compute_rows);
+		}
+
+		glUseProgram(program_id);
+
+		glUniformMatrix3fv(matrix_id, 1, GL_FALSE, glm::value_ptr(view_matrix));
 	
-	    glClear(GL_COLOR_BUFFER_BIT);
+		glEnableVertexAttribArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
 
-	    glUseProgram(program_id);
+		glDrawArrays(GL_TRIANGLES, 0, 12*3);
 
-	    glUniformMatrix3fv(matrix_id, 1, GL_FALSE, glm::value_ptr(view_matrix));
-	
-	    glEnableVertexAttribArray(0);
-	    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
-	    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+		glDisableVertexAttribArray(0);
 
-	    glDrawArrays(GL_TRIANGLES, 0, 12*3);
+		if(mirrored)
+		{
+		    glDisable(GL_SCISSOR_TEST);
 
-	    glDisableVertexAttribArray(0);
-	
-	    glfwSwapBuffers(window);
+		    // Row r comes from row m - r, swapping the destination y flips it
+		    glBindFramebuffer(GL_READ_FRAMEBUFFER, offscreen_fbo);
+		    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, offscreen_fbo);
+		    int src_row = split.m - (split.mirror_row + split.mirror_rows - 1);
+		    glBlitFramebuffer(0, src_row, render_width, src_row + split.mirror_rows,
+				      0, split.mirror_row + split.mirror_rows, render_width, split.mirror_row,
+				      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		}
+
+		// Wait for the GPU so the measured time is the real per-pixel cost
+		glFinish();
+		frame_budget_record(&budget, res_scale, render_width, render_height, glfwGetTime() - render_start);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		shown_texture = offscreen_texture;
+	    }
 	}
-	
-	auto end = std::chrono::high_resolution_clock::now();
-	auto duration = end-start;
-	auto wait_time = std::chrono::milliseconds(16) - duration;
-	if(wait_time >= std::chrono::seconds(0))
+
+	// Recoloring is a pass over the iterations, the fractal isn't shaded
+	// again for palette changes or cycling
+	if(draw_now || palette_changed || cycling)
 	{
-	    std::this_thread::sleep_for(wait_time);
+	    double now = glfwGetTime();
+	    if(cycling)
+	    {
+		palette_offset += PALETTE_CYCLE_SPEED * (now - present_time);
+		palette_offset -= std::floor(palette_offset);
+	    }
+	    present_time = now;
+
+	    if(palette_changed)
+	    {
+		palette_changed = false;
+		u32 palette[PALETTE_SIZE];
+		palette_fill(palette_kind, palette);
+		glBindTexture(GL_TEXTURE_1D, palette_texture);
+		glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA8, PALETTE_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, palette);
+	    }
+	    
+	    // The quad stretches the frame over the window
+	    glViewport(0, 0, framebuffer_width, framebuffer_height);
+	    glClear(GL_COLOR_BUFFER_BIT);
+	    glUseProgram(picture_program_id);
+	    glUniform1f(palette_offset_id, palette_offset);
+	    glActiveTexture(GL_TEXTURE0);
+	    glBindTexture(GL_TEXTURE_2D, shown_texture);
+	    glActiveTexture(GL_TEXTURE1);
+	    glBindTexture(GL_TEXTURE_1D, palette_texture);
+	    glActiveTexture(GL_TEXTURE0);
+	    
+	    glEnableVertexAttribArray(0);
+	    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+	    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat), 0);
+	    glDrawArrays(GL_TRIANGLES, 0, 6);
+	    glDisableVertexAttribArray(0);
+
+	    glfwSwapBuffers(window);
+
+	    // Block until the swap is done so frames don't queue up behind vsync,
+	    // which also makes this the time the frame reaches the screen
+	    glFinish();
+	    latency_presented(&latency, glfwGetTime());
 	}
     }
     
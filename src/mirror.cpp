@@ -0,0 +1,50 @@
+#include <cmath>
+#include <cstring>
+
+#include "mirror.h"
+
+bool mirror_split(double *origin_y, double step, int height, double offset, MirrorSplit *split)
+{
+    // -(o + (r+a)s) == o + (r'+a)s  =>  r' = -2o/s - 2a - r
+    double m_exact = -2 * (*origin_y) / step - 2 * offset;
+    int m = (int)std::lround(m_exact);
+    if(m < 1 || m > 2*height - 3)
+    {
+	// The axis is off screen or right at the edge, no pairs to share
+	return false;
+    }
+
+    split->m = m;
+    if(m < height - 1)
+    {
+	// Axis below the middle, the lower side gets mirrored
+	split->mirror_row = 0;
+	split->mirror_rows = (m + 1) / 2;
+	split->compute_row = split->mirror_rows;
+	split->compute_rows = height - split->compute_row;
+    }
+    else
+    {
+	split->compute_row = 0;
+	split->compute_rows = m / 2 + 1;
+	split->mirror_row = split->compute_rows;
+	split->mirror_rows = height - split->mirror_row;
+    }
+    if(split->mirror_rows <= 0)
+    {
+	return false;
+    }
+    
+    *origin_y = -0.5 * (m + 2 * offset) * step;
+    return true;
+}
+
+void mirror_rows(const MirrorSplit &split, void *pixels, int row_bytes)
+{
+    char *rows = (char*) pixels;
+    for(int r = split.mirror_row; r < split.mirror_row + split.mirror_rows; ++r)
+    {
+	int source = mirror_source_row(split, r);
+	memcpy(rows + (size_t)r * row_bytes, rows + (size_t)source * row_bytes, row_bytes);
+    }
+}
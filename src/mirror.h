@@ -0,0 +1,29 @@
+#ifndef __MIRROR_H__
+#define __MIRROR_H__
+
+// The set is symmetric about the real axis, so when a view straddles it
+// the rows on the smaller side are copies of rows on the other side.
+//
+// Rows are sampled at origin_y + (row + offset) * step, offset being 0 for
+// the kernels and 0.5 for fragment centers. Row r mirrors row m - r.
+struct MirrorSplit
+{
+    int compute_row, compute_rows;  // band that has to be rendered
+    int mirror_row, mirror_rows;    // band copied from the rendered one
+    int m;
+};
+
+// Moves origin_y by at most half a step so the rows line up with their
+// mirror images, and works out which rows need rendering. Returns false,
+// leaving origin_y alone, when nothing can be mirrored.
+bool mirror_split(double *origin_y, double step, int height, double offset, MirrorSplit *split);
+
+inline int mirror_source_row(const MirrorSplit &split, int row)
+{
+    return split.m - row;
+}
+
+// Fills the mirror band of a row-major image from its compute band
+void mirror_rows(const MirrorSplit &split, void *pixels, int row_bytes);
+
+#endif // __MIRROR_H__
@@ -0,0 +1,64 @@
+#include <cmath>
+
+#include "palette.h"
+
+static u32 pack_rgb(float r, float g, float b)
+{
+    u32 red = (u32)(255.0f * r + 0.5f);
+    u32 green = (u32)(255.0f * g + 0.5f);
+    u32 blue = (u32)(255.0f * b + 0.5f);
+    return red | (green << 8) | (blue << 16) | (0xFFu << 24);
+}
+
+static float saturate(float x)
+{
+    return x < 0 ? 0 : x > 1 ? 1 : x;
+}
+
+const char *palette_name(int kind)
+{
+    static const char *names[PALETTE_KINDS] = {"grey", "fire", "waves"};
+    return names[kind];
+}
+
+void palette_fill(int kind, u32 *colors)
+{
+    for(int i = 0; i < PALETTE_SIZE; ++i)
+    {
+	float t = (float)i / (float)(PALETTE_SIZE - 1);
+	if(kind == PALETTE_GREY)
+	{
+	    colors[i] = pack_rgb(t, t, t);
+	}
+	else if(kind == PALETTE_FIRE)
+	{
+	    colors[i] = pack_rgb(saturate(3*t), saturate(3*t - 1), saturate(3*t - 2));
+	}
+	else
+	{
+	    // Whole periods, so it wraps around without a seam
+	    float a = 6.2831853f * 4 * (float)i / (float)PALETTE_SIZE;
+	    colors[i] = pack_rgb(0.5f + 0.5f*std::cos(a), 0.5f + 0.5f*std::cos(a + 2.0f), 0.5f + 0.5f*std::cos(a + 4.0f));
+	}
+    }
+}
+
+u32 palette_color(const u32 *palette, s32 iter, int max_iter, float offset)
+{
+    if(iter < 0)
+    {
+	return 0xFFu << 24;
+    }
+    float t = (float)iter / (float)max_iter + offset;
+    t -= std::floor(t);
+    int index = (int)(t * PALETTE_SIZE);
+    return palette[index < PALETTE_SIZE ? index : PALETTE_SIZE - 1];
+}
+
+void palette_colorize(const u32 *palette, const s32 *iterations, size_t n, int max_iter, float offset, u32 *pixels)
+{
+    for(size_t i = 0; i < n; ++i)
+    {
+	pixels[i] = palette_color(palette, iterations[i], max_iter, offset);
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef __PALETTE_H__
+#define __PALETTE_H__
+
+#include <cstddef>
+
+#include "typedefs.h"
+
+// Entries of a palette, as uploaded to picture.frag's 1D texture
+#define PALETTE_SIZE 256
+// Palette lengths cycled per second while color cycling
+#define PALETTE_CYCLE_SPEED 0.1
+
+enum PaletteKind
+{
+    PALETTE_GREY,     // same ramp test_kernel used to bake in
+    PALETTE_FIRE,
+    PALETTE_WAVES,
+    PALETTE_KINDS
+};
+
+const char *palette_name(int kind);
+// Fills PALETTE_SIZE RGBA8 colors
+void palette_fill(int kind, u32 *colors);
+
+// The color picture.frag gives an escape iteration, for coloring on the
+// CPU. Iterations map to palette positions iter / max_iter + offset,
+// wrapping, and unresolved pixels are black.
+u32 palette_color(const u32 *palette, s32 iter, int max_iter, float offset);
+void palette_colorize(const u32 *palette, const s32 *iterations, size_t n, int max_iter, float offset, u32 *pixels);
+
+#endif // __PALETTE_H__
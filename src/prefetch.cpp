@@ -0,0 +1,114 @@
+#include <cmath>
+
+#include "prefetch.h"
+
+// How far ahead of the current view to predict
+#define PREFETCH_LOOKAHEAD 0.3
+// Motion older than this is a stopped view, not a direction
+#define MOTION_TIMEOUT 0.25
+
+void view_motion_init(ViewMotion *motion, double now)
+{
+    motion->velocity_x = 0;
+    motion->velocity_y = 0;
+    motion->zoom_rate = 0;
+    motion->last_time = now;
+    motion->last_moved = now;
+}
+
+void view_motion_update(ViewMotion *motion, double dx, double dy, double log_zoom, double now)
+{
+    double dt = now - motion->last_time;
+    motion->last_time = now;
+    if(dx != 0 || dy != 0 || log_zoom != 0)
+    {
+	motion->last_moved = now;
+    }
+    if(dt <= 0)
+    {
+	return;
+    }
+    
+    double vx = dx / dt;
+    double vy = dy / dt;
+    double zoom_rate = log_zoom / dt;
+    if(dt > MOTION_TIMEOUT)
+    {
+	// Starting from rest, there is nothing to smooth against
+	motion->velocity_x = vx;
+	motion->velocity_y = vy;
+	motion->zoom_rate = zoom_rate;
+    }
+    else
+    {
+	motion->velocity_x = 0.5 * motion->velocity_x + 0.5 * vx;
+	motion->velocity_y = 0.5 * motion->velocity_y + 0.5 * vy;
+	motion->zoom_rate = 0.5 * motion->zoom_rate + 0.5 * zoom_rate;
+    }
+}
+
+static void region_keys(const RenderRegion &region, int level, int max_iter, s32 precision, std::vector<TileKey> *keys)
+{
+    s64 x0, y0, x1, y1;
+    tile_range(region, level, &x0, &y0, &x1, &y1);
+    for(s64 y = y0; y <= y1; ++y)
+    {
+	for(s64 x = x0; x <= x1; ++x)
+	{
+	    keys->push_back(tile_canonical({level, max_iter, x, y, precision}));
+	}
+    }
+}
+
+void prefetch_keys(const RenderRegion &visible, int level, int max_iter, s32 precision, const ViewMotion &motion, double now, std::vector<TileKey> *keys)
+{
+    keys->clear();
+    // Redraws without input update the motion too, only moves count
+    if(now - motion.last_moved > MOTION_TIMEOUT)
+    {
+	return;
+    }
+
+    // Pan: the visible region moved ahead by the lookahead, tiles already
+    // on screen are in the cache and get skipped by whoever renders them
+    double shift_x = motion.velocity_x * PREFETCH_LOOKAHEAD;
+    double shift_y = motion.velocity_y * PREFETCH_LOOKAHEAD;
+    if(shift_x != 0 || shift_y != 0)
+    {
+	RenderRegion ahead = visible;
+	ahead.origin_x += shift_x;
+	ahead.origin_y += shift_y;
+	region_keys(ahead, level, max_iter, precision, keys);
+    }
+
+    // Zoom: the region the view will cover about the same center
+    if(motion.zoom_rate != 0)
+    {
+	double zoom = std::exp(motion.zoom_rate * PREFETCH_LOOKAHEAD);
+	int next_level = tile_level_for_step(visible.step * zoom);
+	if(next_level == level)
+	{
+	    next_level += motion.zoom_rate < 0 ? 1 : -1;
+	}
+	
+	double center_x = visible.origin_x + 0.5 * visible.width * visible.step;
+	double center_y = visible.origin_y + 0.5 * visible.height * visible.step;
+	
+	RenderRegion zoomed = visible;
+	zoomed.step = visible.step * zoom;
+	zoomed.origin_x = center_x - 0.5 * zoomed.width * zoomed.step;
+	zoomed.origin_y = center_y - 0.5 * zoomed.height * zoomed.step;
+	region_keys(zoomed, next_level, max_iter, precision, keys);
+    }
+}
+
+void prefetch_tiles(TileRenderer *renderer, const RenderRegion &visible, int level, int max_iter, const ViewMotion &motion, double now)
+{
+    tile_renderer_clear_prefetch(renderer);
+    std::vector<TileKey> keys;
+    prefetch_keys(visible, level, max_iter, renderer->precision, motion, now, &keys);
+    for(const TileKey &key : keys)
+    {
+	tile_renderer_request(renderer, key, TILE_PREFETCH);
+    }
+}
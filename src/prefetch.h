@@ -0,0 +1,27 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <vector>
+
+#include "tile_renderer.h"
+
+// Smoothed view motion, fed from the per-frame pan and zoom deltas
+struct ViewMotion
+{
+    double velocity_x, velocity_y;  // plane units per second
+    double zoom_rate;               // d(log scale)/dt, negative zooming in
+    double last_time;               // of the last update
+    double last_moved;              // of the last update the view moved in
+};
+
+void view_motion_init(ViewMotion *motion, double now);
+void view_motion_update(ViewMotion *motion, double dx, double dy, double log_zoom, double now);
+
+// Queues prefetch tiles where the view is heading: just outside the
+// visible region along the pan velocity, and the next zoom level.
+void prefetch_tiles(TileRenderer *renderer, const RenderRegion &visible, int level, int max_iter, const ViewMotion &motion, double now);
+// The same tiles as canonical keys of the given precision, most wanted
+// first, for engines that render outside the tile renderer
+void prefetch_keys(const RenderRegion &visible, int level, int max_iter, s32 precision, const ViewMotion &motion, double now, std::vector<TileKey> *keys);
+
+#endif // __PREFETCH_H__
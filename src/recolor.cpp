@@ -0,0 +1,62 @@
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "typedefs.h"
+#include "defer.h"
+
+#include "cpu_render.h"
+#include "cpu_render.cpp"
+#include "tiles.h"
+#include "tiles.cpp"
+#include "iteration_field.h"
+#include "iteration_field.cpp"
+
+// Colors a saved iteration field into a binary PPM without iterating again
+int main(int argc, char **argv)
+{
+    if(argc < 3)
+    {
+	fprintf(stderr, "Usage: %s <field> <output.ppm> [gradient cycles per iteration]\n", argv[0]);
+	return 1;
+    }
+    float density = argc > 3 ? (float)atof(argv[3]) : 0.02f;
+
+    IterationField field;
+    if(!iteration_field_map(argv[1], &field))
+    {
+	return 1;
+    }
+    defer { iteration_field_free(&field); };
+
+    int width = field.header.width;
+    int height = field.header.height;
+    std::vector<u32> pixels((size_t)width * height);
+    iteration_field_colorize(field, density, pixels.data());
+
+    FILE *file = fopen(argv[2], "wb");
+    if(!file)
+    {
+	fprintf(stderr, "Unable to open '%s' for writing\n", argv[2]);
+	return 1;
+    }
+    defer { fclose(file); };
+
+    // PPM starts at the top row
+    fprintf(file, "P6\n%i %i\n255\n", width, height);
+    std::vector<u8> row((size_t)width * 3);
+    for(int y = height - 1; y >= 0; --y)
+    {
+	for(int x = 0; x < width; ++x)
+	{
+	    u32 color = pixels[(size_t)y * width + x];
+	    row[3*x + 0] = color & 0xFF;
+	    row[3*x + 1] = (color >> 8) & 0xFF;
+	    row[3*x + 2] = (color >> 16) & 0xFF;
+	}
+	fwrite(row.data(), 1, row.size(), file);
+    }
+
+    printf("%ix%i, max_iter %i, colored into '%s'\n", width, height, field.header.max_iter, argv[2]);
+    return 0;
+}
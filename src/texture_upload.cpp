@@ -0,0 +1,182 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include "texture_upload.h"
+
+void texture_upload_init(TextureUpload *upload, bool sample_direct)
+{
+    memset(upload, 0, sizeof(*upload));
+    upload->sample_direct = sample_direct;
+    glGenBuffers(TEXTURE_UPLOAD_PBOS, upload->pbos);
+    glGenQueries(TEXTURE_UPLOAD_QUERIES, upload->queries);
+    for(int i = 0; i < TEXTURE_UPLOAD_QUERIES; ++i)
+    {
+	upload->query_kinds[i] = -1;
+    }
+}
+
+void texture_upload_release(TextureUpload *upload)
+{
+    glDeleteBuffers(TEXTURE_UPLOAD_PBOS, upload->pbos);
+    glDeleteQueries(TEXTURE_UPLOAD_QUERIES, upload->queries);
+    memset(upload, 0, sizeof(*upload));
+}
+
+void texture_upload_set_path(TextureUpload *upload, TextureUploadPath path, void *user, const char *name)
+{
+    upload->path = path;
+    upload->path_user = user;
+    upload->path_name = name;
+    upload->path_stale = true;
+}
+
+// Adds a query's GPU time to its kind. Queries are read uploads after they
+// ended, so this rarely waits.
+static void collect_query(TextureUpload *upload, int query)
+{
+    int kind = upload->query_kinds[query];
+    if(kind < 0)
+    {
+	return;
+    }
+    GLuint64 ns = 0;
+    glGetQueryObjectui64v(upload->queries[query], GL_QUERY_RESULT, &ns);
+    upload->gpu_seconds[kind] += (double)ns * 1e-9;
+    upload->query_kinds[query] = -1;
+}
+
+static void begin_query(TextureUpload *upload, int kind)
+{
+    int query = upload->next_query;
+    upload->next_query = (query + 1) % TEXTURE_UPLOAD_QUERIES;
+    collect_query(upload, query);
+    glBeginQuery(GL_TIME_ELAPSED, upload->queries[query]);
+    upload->query_kinds[query] = kind;
+}
+
+void texture_upload_iterations(TextureUpload *upload, GLuint texture, int width, int height, const s32 *iterations)
+{
+    size_t bytes = (size_t)width * height * sizeof(s32);
+
+    glBindTexture(GL_TEXTURE_2D, texture);
+    if(width != upload->width || height != upload->height)
+    {
+	// Allocated on its own, so every path only ever updates it
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32I, width, height, 0, GL_RED_INTEGER, GL_INT, nullptr);
+	upload->width = width;
+	upload->height = height;
+	upload->path_stale = true;
+    }
+
+    u64 n = upload->uploads;
+    upload->uploads += 1;
+    int kind = TEXTURE_UPLOAD_PBO;
+    if(upload->sample_direct && n % TEXTURE_UPLOAD_SAMPLE_EVERY == TEXTURE_UPLOAD_SAMPLE_EVERY - 1)
+    {
+	kind = TEXTURE_UPLOAD_DIRECT;
+    }
+    else if(upload->path && n % TEXTURE_UPLOAD_SAMPLE_EVERY != TEXTURE_UPLOAD_SAMPLE_EVERY / 2 - 1)
+    {
+	kind = TEXTURE_UPLOAD_PATH;
+    }
+
+    if(kind == TEXTURE_UPLOAD_PATH)
+    {
+	auto start = std::chrono::steady_clock::now();
+	if(upload->path(upload->path_user, texture, width, height, iterations, upload->path_stale))
+	{
+	    upload->path_stale = false;
+	    upload->host_seconds[kind] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	    upload->bytes[kind] += bytes;
+	    return;
+	}
+	fprintf(stderr, "Texture uploads through %s failed, using PBOs\n", upload->path_name);
+	upload->path = nullptr;
+	kind = TEXTURE_UPLOAD_PBO;
+	glBindTexture(GL_TEXTURE_2D, texture);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    if(kind == TEXTURE_UPLOAD_PBO)
+    {
+	// Orphan the buffer before filling it, so the driver hands out fresh
+	// memory rather than wait for an upload still reading the old one
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload->pbos[upload->next]);
+	upload->next = (upload->next + 1) % TEXTURE_UPLOAD_PBOS;
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+	void *mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if(mapped)
+	{
+	    memcpy(mapped, iterations, bytes);
+	    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	    begin_query(upload, kind);
+	    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RED_INTEGER, GL_INT, nullptr);
+	    glEndQuery(GL_TIME_ELAPSED);
+	}
+	else
+	{
+	    kind = TEXTURE_UPLOAD_DIRECT;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+    if(kind == TEXTURE_UPLOAD_DIRECT)
+    {
+	begin_query(upload, kind);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RED_INTEGER, GL_INT, iterations);
+	glEndQuery(GL_TIME_ELAPSED);
+    }
+
+    upload->host_seconds[kind] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    upload->bytes[kind] += bytes;
+}
+
+void texture_upload_report(TextureUpload *upload)
+{
+    for(int i = 0; i < TEXTURE_UPLOAD_QUERIES; ++i)
+    {
+	collect_query(upload, i);
+    }
+    if(upload->uploads == 0)
+    {
+	return;
+    }
+    double mb = 1.0 / (1 << 20);
+    u64 total_bytes = 0;
+    for(int kind = 0; kind < TEXTURE_UPLOAD_KINDS; ++kind)
+    {
+	total_bytes += upload->bytes[kind];
+    }
+    double frame_bytes = (double)total_bytes / upload->uploads;
+    printf("texture uploads: %llu frames, %.1f MB each\n", (unsigned long long)upload->uploads, frame_bytes * mb);
+
+    // Per byte, since frames change size
+    const char *names[TEXTURE_UPLOAD_KINDS] = {"through PBOs", "direct", upload->path_name};
+    double per_frame[TEXTURE_UPLOAD_KINDS];
+    for(int kind = 0; kind < TEXTURE_UPLOAD_KINDS; ++kind)
+    {
+	if(upload->bytes[kind] == 0)
+	{
+	    continue;
+	}
+	double scale = frame_bytes / upload->bytes[kind];
+	double host = upload->host_seconds[kind] * scale;
+	double gpu = upload->gpu_seconds[kind] * scale;
+	per_frame[kind] = host + gpu;
+	if(kind == TEXTURE_UPLOAD_PATH)
+	{
+	    printf("  %s %.2f ms per frame, until the texture holds it\n", names[kind], 1000 * per_frame[kind]);
+	}
+	else
+	{
+	    printf("  %s %.2f ms per frame, %.2f ms host time in the calls and %.2f ms GPU time\n", names[kind],
+		   1000 * per_frame[kind], 1000 * host, 1000 * gpu);
+	}
+    }
+    if(upload->bytes[TEXTURE_UPLOAD_PBO] > 0 && upload->bytes[TEXTURE_UPLOAD_PATH] > 0)
+    {
+	double saved = per_frame[TEXTURE_UPLOAD_PBO] - per_frame[TEXTURE_UPLOAD_PATH];
+	printf("  %s %s %.2f ms of transfer time per frame against PBOs\n", names[TEXTURE_UPLOAD_PATH],
+	       saved >= 0 ? "saves" : "loses", 1000 * (saved >= 0 ? saved : -saved));
+    }
+}
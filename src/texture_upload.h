@@ -0,0 +1,71 @@
+#ifndef __TEXTURE_UPLOAD_H__
+#define __TEXTURE_UPLOAD_H__
+
+#include "typedefs.h"
+
+// Pixel buffer objects uploads alternate between
+#define TEXTURE_UPLOAD_PBOS 2
+// With sample_direct, one upload in this many goes straight from client
+// memory, to compare the two paths. With another path, one in this many
+// still goes through the PBOs.
+#define TEXTURE_UPLOAD_SAMPLE_EVERY 32
+// GPU timer queries in flight, each read back this many uploads later
+#define TEXTURE_UPLOAD_QUERIES 4
+
+enum TextureUploadKind
+{
+    TEXTURE_UPLOAD_PBO,
+    TEXTURE_UPLOAD_DIRECT,
+    TEXTURE_UPLOAD_PATH,
+    TEXTURE_UPLOAD_KINDS
+};
+
+// Another way into the texture, such as OpenCL writing it through
+// cl_khr_gl_sharing. It gets the texture with storage of width x height
+// already allocated, reallocated says whether that storage is new since
+// the last call. It returns once the texture holds the frame, or false if
+// it can't, and the PBOs take over for good.
+typedef bool (*TextureUploadPath)(void *user, GLuint texture, int width, int height, const s32 *iterations, bool reallocated);
+
+// Streams frames of iterations into one GL_R32I texture through pixel
+// buffer objects. Filling one is a copy into driver memory, and the
+// texture is then updated from it asynchronously, where glTexImage2D from
+// client memory holds the caller up until the driver has taken everything.
+struct TextureUpload
+{
+    GLuint pbos[TEXTURE_UPLOAD_PBOS];
+    int next;
+    int width, height;   // of the texture's storage
+    bool sample_direct;
+
+    TextureUploadPath path;
+    void *path_user;
+    const char *path_name;
+    bool path_stale;     // the storage changed since the path last ran
+
+    // The GPU time of the texture updates from the PBOs or client memory,
+    // which the host time doesn't see
+    GLuint queries[TEXTURE_UPLOAD_QUERIES];
+    int query_kinds[TEXTURE_UPLOAD_QUERIES];   // -1 when not in flight
+    int next_query;
+
+    // Per TextureUploadKind. Host time is spent in the calls, a path only
+    // returns once the texture is updated so all of its time is host time.
+    u64 uploads;
+    double host_seconds[TEXTURE_UPLOAD_KINDS];
+    double gpu_seconds[TEXTURE_UPLOAD_KINDS];
+    u64 bytes[TEXTURE_UPLOAD_KINDS];
+};
+
+void texture_upload_init(TextureUpload *upload, bool sample_direct);
+void texture_upload_release(TextureUpload *upload);
+// Sends frames through path from now on, name is for the report
+void texture_upload_set_path(TextureUpload *upload, TextureUploadPath path, void *user, const char *name);
+// Gives texture width x height iterations, reallocating its storage when
+// the size changes
+void texture_upload_iterations(TextureUpload *upload, GLuint texture, int width, int height, const s32 *iterations);
+// Collects the GPU timings still in flight and prints the time per frame
+// on each path, and what the other path saves against the PBOs
+void texture_upload_report(TextureUpload *upload);
+
+#endif // __TEXTURE_UPLOAD_H__
@@ -0,0 +1,402 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "tile_cache.h"
+#include "tile_codec.h"
+#include "hash.h"
+
+Tile *tile_alloc_iterations()
+{
+    Tile *tile = new Tile;
+    tile->iterations = (s32*) malloc(TILE_SIZE*TILE_SIZE*sizeof(s32));
+    tile->iter_done = 0;
+    tile->refining = false;
+    tile->resumable = false;
+    tile->payload = nullptr;
+    tile->packed = nullptr;
+    tile->store = nullptr;
+    tile->slot = 0;
+    return tile;
+}
+
+static void release_payload(TilePayload *payload)
+{
+    std::lock_guard<std::mutex> guard(payload->pool->lock);
+    payload->refs -= 1;
+    if(payload->refs > 0)
+    {
+	return;
+    }
+    
+    auto range = payload->pool->payloads.equal_range(payload->hash);
+    for(auto it = range.first; it != range.second; ++it)
+    {
+	if(it->second == payload)
+	{
+	    payload->pool->payloads.erase(it);
+	    break;
+	}
+    }
+    free(payload->data);
+    delete payload;
+}
+
+void tile_free(Tile *tile)
+{
+    if(tile->store)
+    {
+	tile_store_unpin(tile->store, tile->slot);
+    }
+    else if(tile->payload)
+    {
+	release_payload(tile->payload);
+    }
+    else
+    {
+	free(tile->iterations);
+    }
+    delete tile;
+}
+
+size_t tile_bytes(const Tile *tile)
+{
+    // Mapped tiles live in the page cache, which the kernel can drop itself
+    if(tile->store)
+    {
+	return sizeof(Tile);
+    }
+    size_t data_bytes = TILE_BYTES;
+    if(tile->payload)
+    {
+	data_bytes = tile->payload->bytes / tile->payload->refs;
+    }
+    return sizeof(Tile) + data_bytes + tile->unresolved.capacity() * sizeof(PixelState);
+}
+
+u64 tile_content_hash(const void *data, size_t bytes)
+{
+    return hash_bytes(HASH_SEED, data, bytes);
+}
+
+void tile_share(TilePool *pool, Tile *tile)
+{
+    if(tile->payload || tile->store)
+    {
+	return;
+    }
+
+    // Packing is deterministic, so equal packed bytes mean equal tiles
+    u64 hash = tile_content_hash(tile->iterations, TILE_BYTES);
+    size_t bytes;
+    void *data = tile_pack(tile->iterations, TILE_SIZE*TILE_SIZE, &bytes);
+    free(tile->iterations);
+    tile->iterations = nullptr;
+
+    std::lock_guard<std::mutex> guard(pool->lock);
+    TilePayload *payload = nullptr;
+    auto range = pool->payloads.equal_range(hash);
+    for(auto it = range.first; it != range.second; ++it)
+    {
+	TilePayload *other = it->second;
+	if(other->bytes == bytes && memcmp(other->data, data, bytes) == 0)
+	{
+	    payload = other;
+	    break;
+	}
+    }
+    
+    if(payload)
+    {
+	free(data);
+	payload->refs += 1;
+    }
+    else
+    {
+	payload = new TilePayload;
+	payload->pool = pool;
+	payload->hash = hash;
+	payload->refs = 1;
+	payload->bytes = bytes;
+	payload->data = data;
+	pool->payloads.emplace(hash, payload);
+    }
+    
+    tile->payload = payload;
+    tile->packed = (const u8*)payload->data;
+}
+
+void tile_unshare(Tile *tile)
+{
+    TilePayload *payload = tile->payload;
+    if(!payload)
+    {
+	return;
+    }
+
+    tile->iterations = (s32*) malloc(TILE_BYTES);
+    tile_unpack(tile->packed, TILE_SIZE*TILE_SIZE, tile->iterations);
+    tile->payload = nullptr;
+    tile->packed = nullptr;
+    release_payload(payload);
+}
+
+static TileKey place_of(TileKey key)
+{
+    key.max_iter = 0;
+    return key;
+}
+
+static void add_place(TileCache *cache, const TileKey &key)
+{
+    cache->places.emplace(place_of(key), key.max_iter);
+}
+
+static void remove_place(TileCache *cache, const TileKey &key)
+{
+    auto range = cache->places.equal_range(place_of(key));
+    for(auto it = range.first; it != range.second; ++it)
+    {
+	if(it->second == key.max_iter)
+	{
+	    cache->places.erase(it);
+	    return;
+	}
+    }
+}
+
+// Finished tiles that aren't on disk yet go to the store, which frees them
+static void evict(TileCache *cache, const TileKey &key, Tile *tile)
+{
+    if(cache->store && !tile->store && tile->iter_done >= key.max_iter)
+    {
+	tile_store_write(cache->store, key, tile);
+    }
+    else
+    {
+	tile_free(tile);
+    }
+}
+
+void tile_cache_init(TileCache *cache, size_t budget, TileStore *store)
+{
+    cache->store = store;
+    cache->budget = budget;
+    cache->bytes = 0;
+    cache->frame = 1;
+}
+
+void tile_cache_release(TileCache *cache)
+{
+    for(auto &entry : cache->entries)
+    {
+	evict(cache, entry.first, entry.second.tile);
+    }
+    cache->entries.clear();
+    cache->lru.clear();
+    cache->places.clear();
+    cache->bytes = 0;
+}
+
+Tile *tile_cache_find(TileCache *cache, const TileKey &key)
+{
+    auto it = cache->entries.find(key);
+    if(it != cache->entries.end())
+    {
+	return it->second.tile;
+    }
+    
+    Tile *tile = cache->store ? tile_store_load(cache->store, key) : nullptr;
+    if(tile)
+    {
+	tile_cache_insert(cache, key, tile);
+    }
+    return tile;
+}
+
+void tile_cache_insert(TileCache *cache, const TileKey &key, Tile *tile)
+{
+    auto it = cache->entries.find(key);
+    if(it != cache->entries.end())
+    {
+	tile_free(it->second.tile);
+	cache->lru.erase(it->second.lru);
+	cache->entries.erase(it);
+    }
+    else
+    {
+	add_place(cache, key);
+    }
+    
+    if(tile->iter_done >= key.max_iter && !tile->refining)
+    {
+	tile_share(&cache->pool, tile);
+    }
+    
+    cache->lru.push_front(key);
+    TileCache::Entry entry = {tile, cache->lru.begin(), 0};
+    cache->entries[key] = entry;
+    cache->bytes += tile_bytes(tile);
+}
+
+void tile_cache_rekey(TileCache *cache, const TileKey &from, const TileKey &to)
+{
+    auto it = cache->entries.find(from);
+    if(it == cache->entries.end())
+    {
+	return;
+    }
+    TileCache::Entry entry = it->second;
+    cache->entries.erase(it);
+    remove_place(cache, from);
+    *entry.lru = to;
+    cache->entries[to] = entry;
+    add_place(cache, to);
+}
+
+bool tile_cache_find_shallower(TileCache *cache, const TileKey &key, TileKey *found)
+{
+    auto range = cache->places.equal_range(place_of(key));
+    for(auto it = range.first; it != range.second; ++it)
+    {
+	TileKey old_key = key;
+	old_key.max_iter = it->second;
+	const Tile *tile = cache->entries[old_key].tile;
+	if(old_key.max_iter < key.max_iter && tile->resumable && !tile->store)
+	{
+	    *found = old_key;
+	    return true;
+	}
+    }
+    return false;
+}
+
+bool tile_cache_key_of(TileCache *cache, const TileKey &place, const Tile *tile, TileKey *key)
+{
+    auto range = cache->places.equal_range(place_of(place));
+    for(auto it = range.first; it != range.second; ++it)
+    {
+	TileKey other = place;
+	other.max_iter = it->second;
+	if(cache->entries[other].tile == tile)
+	{
+	    *key = other;
+	    return true;
+	}
+    }
+    return false;
+}
+
+void tile_cache_missing(TileCache *cache, const RenderRegion &region, int level, int max_iter,
+			s32 precision, std::vector<TileKey> *missing)
+{
+    s64 x0, y0, x1, y1;
+    tile_range(region, level, &x0, &y0, &x1, &y1);
+    missing->clear();
+    for(s64 y = y0; y <= y1; ++y)
+    {
+	for(s64 x = x0; x <= x1; ++x)
+	{
+	    TileKey key = tile_canonical({level, max_iter, x, y, precision});
+	    if(tile_cache_find(cache, key))
+	    {
+		continue;
+	    }
+	    // Both sides of the axis may be on screen
+	    bool listed = false;
+	    for(const TileKey &other : *missing)
+	    {
+		listed = listed || other == key;
+	    }
+	    if(!listed)
+	    {
+		missing->push_back(key);
+	    }
+	}
+    }
+}
+
+void tile_cache_compose(TileCache *cache, const RenderRegion &region, int level, int max_iter,
+			s32 precision, s32 *out)
+{
+    s64 x0, y0, x1, y1;
+    tile_range(region, level, &x0, &y0, &x1, &y1);
+    for(s64 y = y0; y <= y1; ++y)
+    {
+	for(s64 x = x0; x <= x1; ++x)
+	{
+	    TileKey key = {level, max_iter, x, y, precision};
+	    auto it = cache->entries.find(tile_canonical(key));
+	    if(it == cache->entries.end())
+	    {
+		continue;
+	    }
+	    
+	    TileCache::Entry &entry = it->second;
+	    entry.used_frame = cache->frame;
+	    cache->lru.splice(cache->lru.begin(), cache->lru, entry.lru);
+	    if(entry.tile->packed)
+	    {
+		cache->unpacked.resize(TILE_SIZE*TILE_SIZE);
+		tile_unpack(entry.tile->packed, TILE_SIZE*TILE_SIZE, cache->unpacked.data());
+		tile_blit(key, cache->unpacked.data(), region, out);
+	    }
+	    else
+	    {
+		tile_blit(key, entry.tile->iterations, region, out);
+	    }
+	}
+    }
+}
+
+void tile_cache_report(TileCache *cache)
+{
+    size_t bytes = 0;
+    size_t n_tiles = 0;
+    for(auto &entry : cache->entries)
+    {
+	// Mapped tiles aren't held in memory
+	if(!entry.second.tile->store)
+	{
+	    bytes += tile_bytes(entry.second.tile);
+	    n_tiles += 1;
+	}
+    }
+    if(n_tiles == 0)
+    {
+	return;
+    }
+
+    double megapixels = n_tiles * (double)(TILE_SIZE*TILE_SIZE) / 1e6;
+    printf("Tile cache: %zu tiles in %.1f MB, %.2f MB per megapixel (%.2f unpacked)\n", n_tiles,
+	   bytes / 1e6, bytes / 1e6 / megapixels, TILE_BYTES / 1e6 / ((TILE_SIZE*TILE_SIZE) / 1e6));
+}
+
+void tile_cache_trim(TileCache *cache)
+{
+    // Resume state shrinks as tiles get refined, so sum the sizes afresh
+    cache->bytes = 0;
+    for(auto &entry : cache->entries)
+    {
+	cache->bytes += tile_bytes(entry.second.tile);
+    }
+
+    auto it = cache->lru.end();
+    while(cache->bytes > cache->budget && it != cache->lru.begin())
+    {
+	--it;
+	auto found = cache->entries.find(*it);
+	const TileCache::Entry &entry = found->second;
+	if(entry.used_frame == cache->frame || entry.tile->refining)
+	{
+	    continue;
+	}
+	cache->bytes -= tile_bytes(entry.tile);
+	evict(cache, found->first, entry.tile);
+	remove_place(cache, found->first);
+	cache->entries.erase(found);
+	it = cache->lru.erase(it);
+    }
+    
+    cache->frame += 1;
+}
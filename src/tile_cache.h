@@ -0,0 +1,131 @@
+#ifndef __TILE_CACHE_H__
+#define __TILE_CACHE_H__
+
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "typedefs.h"
+#include "tiles.h"
+#include "tile_store.h"
+
+#define TILE_CACHE_DEFAULT_BUDGET ((size_t)256 << 20)
+#define TILE_BYTES ((size_t)TILE_SIZE*TILE_SIZE*sizeof(u32))
+
+struct TilePool;
+
+// Finished tile contents, packed, shared by every tile with the same bytes
+struct TilePayload
+{
+    TilePool *pool;
+    u64 hash;         // of the unpacked contents
+    u32 refs;
+    size_t bytes;
+    void *data;
+};
+
+struct TilePool
+{
+    std::mutex lock;
+    std::unordered_multimap<u64, TilePayload*> payloads;
+};
+
+struct Tile
+{
+    s32 *iterations;                      // TILE_SIZE^2, -1 until resolved
+    std::vector<PixelState> unresolved;   // pixels that haven't escaped yet
+    s32 iter_done;                        // cap reached so far
+    bool refining;                        // unresolved is out with a worker
+    bool resumable;                       // unresolved has every such pixel
+
+    // Set once finished, packed then points into it
+    TilePayload *payload;
+    const u8 *packed;                     // instead of iterations, see tile_codec.h
+    
+    // Set when the data is mapped in place from a tile store
+    TileStore *store;
+    u32 slot;
+};
+
+Tile *tile_alloc_iterations();
+void tile_free(Tile *tile);
+// Shared contents are split between the tiles using them
+size_t tile_bytes(const Tile *tile);
+u64 tile_content_hash(const void *data, size_t bytes);
+
+// Shares the contents of a finished tile with any identical tile in pool,
+// packing its iterations
+void tile_share(TilePool *pool, Tile *tile);
+// Gives a tile its own copy of its contents again, before changing them
+void tile_unshare(Tile *tile);
+
+// Quadtree of tiles from every engine, least recently used first out once
+// the tiles and their resume state outgrow the byte budget. With a tile
+// store, misses are looked up on disk and finished tiles are written out
+// as they're evicted. Finished tiles with the same contents, such as all
+// interior tiles, share one copy.
+//
+// Callers hold lock around every call. Tiles are only changed under it,
+// and only freed by tile_cache_trim and tile_cache_release.
+struct TileCache
+{
+    std::mutex lock;
+    
+    struct Entry
+    {
+	Tile *tile;
+	std::list<TileKey>::iterator lru;   // position in lru
+	u64 used_frame;
+    };
+    std::unordered_map<TileKey, Entry, TileKeyHash> entries;
+    std::list<TileKey> lru;                 // most recently used first
+    // The max_iters cached at each position, keyed by the key with a
+    // max_iter of 0, so a position's tiles are found without a scan
+    std::unordered_multimap<TileKey, s32, TileKeyHash> places;
+    
+    TileStore *store;
+    TilePool pool;
+    size_t budget;
+    size_t bytes;                           // as of the last trim
+    u64 frame;
+    std::vector<s32> unpacked;              // one tile, for compose
+};
+
+// store may be null
+void tile_cache_init(TileCache *cache, size_t budget, TileStore *store);
+// Hands the finished tiles to the store, close it after this
+void tile_cache_release(TileCache *cache);
+
+Tile *tile_cache_find(TileCache *cache, const TileKey &key);
+// Takes ownership of tile, replacing any tile under key. Finished tiles
+// are shared.
+void tile_cache_insert(TileCache *cache, const TileKey &key, Tile *tile);
+// Moves the tile under from to to, keeping its place in the LRU order
+void tile_cache_rekey(TileCache *cache, const TileKey &from, const TileKey &to);
+// A tile at the same position and precision as key but a lower max_iter,
+// that still has the state to resume it
+bool tile_cache_find_shallower(TileCache *cache, const TileKey &key, TileKey *found);
+// The key a tile is stored under, it changes when a tile is deepened.
+// place is any key at the tile's position.
+bool tile_cache_key_of(TileCache *cache, const TileKey &place, const Tile *tile, TileKey *key);
+
+// Canonical keys of the tiles at level covering region that aren't cached.
+// Tiles on both sides of the real axis share one canonical tile.
+void tile_cache_missing(TileCache *cache, const RenderRegion &region, int level, int max_iter,
+			s32 precision, std::vector<TileKey> *missing);
+// Blits the iterations of the cached tiles at level covering region into
+// out, and marks them used by this frame. Pixels of missing tiles are left
+// alone.
+void tile_cache_compose(TileCache *cache, const RenderRegion &region, int level, int max_iter,
+			s32 precision, s32 *out);
+
+// Prints what the cached tiles take per megapixel, against unpacked u32s
+void tile_cache_report(TileCache *cache);
+
+// Evicts least recently used tiles until the cache fits its budget. Tiles
+// the last compose used and tiles being refined stay. Ends the frame.
+void tile_cache_trim(TileCache *cache);
+
+#endif // __TILE_CACHE_H__
@@ -0,0 +1,235 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "tile_codec.h"
+
+// Run lengths are u16, so longer inputs never use runs
+#define TILE_PACK_MAX_RUN 65536
+
+static inline u32 zigzag(u32 delta)
+{
+    return (delta << 1) ^ (u32)((s32)delta >> 31);
+}
+
+static inline u32 unzigzag(u32 value)
+{
+    return (value >> 1) ^ (0u - (value & 1));
+}
+
+static u8 value_width(u32 bits)
+{
+    return bits <= 0xFF ? 1 : bits <= 0xFFFF ? 2 : 4;
+}
+
+static size_t runs_offset(size_t n_runs)
+{
+    return sizeof(TilePackHeader) + (n_runs*sizeof(u16) + 3) / 4 * 4;
+}
+
+template<typename T>
+static void pack_raw(const s32 *iterations, size_t n, T *out)
+{
+    for(size_t i = 0; i < n; ++i)
+    {
+	out[i] = (T)((u32)iterations[i] + 1);
+    }
+}
+
+template<typename T>
+static void pack_delta(const s32 *iterations, size_t n, T *out)
+{
+    if(n == 0)
+    {
+	return;
+    }
+    out[0] = (T)zigzag((u32)iterations[0] + 1);
+    for(size_t i = 1; i < n; ++i)
+    {
+	out[i] = (T)zigzag((u32)iterations[i] - (u32)iterations[i-1]);
+    }
+}
+
+// Values compared at a time while looking for the end of a run
+#define TILE_PACK_BLOCK 16
+
+template<typename T>
+static void pack_runs(const s32 *iterations, size_t n, u16 *lengths, T *values)
+{
+    size_t run = 0;
+    size_t start = 0;
+    while(start < n)
+    {
+	// Skip whole blocks of the same value, then find the end one by one
+	s32 value = iterations[start];
+	size_t end = start + 1;
+	while(end + TILE_PACK_BLOCK <= n)
+	{
+	    u32 differ = 0;
+	    for(int i = 0; i < TILE_PACK_BLOCK; ++i)
+	    {
+		differ |= (u32)(iterations[end + i] ^ value);
+	    }
+	    if(differ)
+	    {
+		break;
+	    }
+	    end += TILE_PACK_BLOCK;
+	}
+	while(end < n && iterations[end] == value)
+	{
+	    ++end;
+	}
+	
+	lengths[run] = (u16)(end - start - 1);
+	values[run] = (T)((u32)value + 1);
+	++run;
+	start = end;
+    }
+}
+
+template<typename T>
+static void unpack_raw(const T *in, size_t n, s32 *iterations)
+{
+    for(size_t i = 0; i < n; ++i)
+    {
+	iterations[i] = (s32)in[i] - 1;
+    }
+}
+
+template<typename T>
+static void unpack_delta(const T *in, size_t n, s32 *iterations)
+{
+    u32 value = 0;
+    for(size_t i = 0; i < n; ++i)
+    {
+	value += unzigzag(in[i]);
+	iterations[i] = (s32)(value - 1);
+    }
+}
+
+template<typename T>
+static void unpack_runs(const u16 *lengths, const T *values, size_t n_runs, s32 *iterations)
+{
+    for(size_t run = 0; run < n_runs; ++run)
+    {
+	s32 value = (s32)values[run] - 1;
+	size_t length = (size_t)lengths[run] + 1;
+	for(size_t i = 0; i < length; ++i)
+	{
+	    iterations[i] = value;
+	}
+	iterations += length;
+    }
+}
+
+template<typename T>
+static void pack_as(const TilePackHeader &header, const s32 *iterations, size_t n, u8 *packed)
+{
+    u8 *data = packed + sizeof(TilePackHeader);
+    if(header.mode == TILE_PACK_RAW)
+    {
+	pack_raw(iterations, n, (T*)data);
+    }
+    else if(header.mode == TILE_PACK_DELTA)
+    {
+	pack_delta(iterations, n, (T*)data);
+    }
+    else
+    {
+	pack_runs(iterations, n, (u16*)data, (T*)(packed + runs_offset(header.count)));
+    }
+}
+
+template<typename T>
+static void unpack_as(const TilePackHeader &header, const u8 *packed, size_t n, s32 *iterations)
+{
+    const u8 *data = packed + sizeof(TilePackHeader);
+    if(header.mode == TILE_PACK_RAW)
+    {
+	unpack_raw((const T*)data, n, iterations);
+    }
+    else if(header.mode == TILE_PACK_DELTA)
+    {
+	unpack_delta((const T*)data, n, iterations);
+    }
+    else
+    {
+	unpack_runs((const u16*)data, (const T*)(packed + runs_offset(header.count)), header.count, iterations);
+    }
+}
+
+u8 *tile_pack(const s32 *iterations, size_t n, size_t *bytes_out)
+{
+    // One pass for the size of every mode. The width only depends on the
+    // top bit, so or-ing the values stands in for their maximum and keeps
+    // the loop vectorizable on plain SSE2.
+    u32 value_bits = 0;
+    u32 delta_bits = 0;
+    u32 n_changes = 0;
+    if(n > 0)
+    {
+	value_bits = (u32)iterations[0] + 1;
+	delta_bits = zigzag(value_bits);
+    }
+    for(size_t i = 1; i < n; ++i)
+    {
+	value_bits |= (u32)iterations[i] + 1;
+	delta_bits |= zigzag((u32)iterations[i] - (u32)iterations[i-1]);
+	n_changes += iterations[i] != iterations[i-1];
+    }
+    size_t n_runs = n > 0 ? n_changes + 1 : 0;
+
+    TilePackHeader header = {TILE_PACK_RAW, value_width(value_bits), 0, (u32)n};
+    size_t bytes = sizeof(header) + n*header.width;
+
+    u8 delta_width = value_width(delta_bits);
+    if(sizeof(header) + n*delta_width < bytes)
+    {
+	header = {TILE_PACK_DELTA, delta_width, 0, (u32)n};
+	bytes = sizeof(header) + n*delta_width;
+    }
+
+    u8 runs_width = value_width(value_bits);
+    size_t runs_bytes = runs_offset(n_runs) + n_runs*runs_width;
+    if(n <= TILE_PACK_MAX_RUN && runs_bytes < bytes)
+    {
+	header = {TILE_PACK_RUNS, runs_width, 0, (u32)n_runs};
+	bytes = runs_bytes;
+    }
+
+    u8 *packed = (u8*) malloc(bytes);
+    memcpy(packed, &header, sizeof(header));
+    if(header.width == 1)
+    {
+	pack_as<u8>(header, iterations, n, packed);
+    }
+    else if(header.width == 2)
+    {
+	pack_as<u16>(header, iterations, n, packed);
+    }
+    else
+    {
+	pack_as<u32>(header, iterations, n, packed);
+    }
+
+    *bytes_out = bytes;
+    return packed;
+}
+
+void tile_unpack(const u8 *packed, size_t n, s32 *iterations)
+{
+    TilePackHeader header;
+    memcpy(&header, packed, sizeof(header));
+    if(header.width == 1)
+    {
+	unpack_as<u8>(header, packed, n, iterations);
+    }
+    else if(header.width == 2)
+    {
+	unpack_as<u16>(header, packed, n, iterations);
+    }
+    else
+    {
+	unpack_as<u32>(header, packed, n, iterations);
+    }
+}
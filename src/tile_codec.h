@@ -0,0 +1,34 @@
+#ifndef __TILE_CODEC_H__
+#define __TILE_CODEC_H__
+
+#include <cstddef>
+
+#include "typedefs.h"
+
+enum TilePackMode
+{
+    TILE_PACK_RAW,      // every value
+    TILE_PACK_DELTA,    // zigzag differences to the previous value
+    TILE_PACK_RUNS      // run lengths and values
+};
+
+// Start of a packed tile. Values are escape iterations + 1, so unresolved
+// pixels are 0, stored at the narrowest of 1, 2 or 4 bytes that fits the
+// largest one. Runs keep their u16 lengths - 1 first, then the values from
+// the next 4 byte boundary.
+struct TilePackHeader
+{
+    u8 mode;      // TilePackMode
+    u8 width;     // bytes per value
+    u16 unused;
+    u32 count;    // values, or runs
+};
+
+// Packs n escape iterations (-1 when unresolved) into a malloc'd buffer, in
+// whichever mode comes out smallest. The loops are plain enough for the
+// compiler to vectorize, so packing is cheap next to rendering the tile.
+u8 *tile_pack(const s32 *iterations, size_t n, size_t *bytes_out);
+// Unpacks into n iterations
+void tile_unpack(const u8 *packed, size_t n, s32 *iterations);
+
+#endif // __TILE_CODEC_H__
@@ -0,0 +1,440 @@
+#include "tile_renderer.h"
+
+// Work the OpenCL devices can take as well
+static void notify_new_tiles(TileRenderer *renderer)
+{
+    renderer->work_ready.notify_one();
+    renderer->cl_work_ready.notify_one();
+}
+
+static void worker_main(TileRenderer *renderer)
+{
+    TileCache *cache = renderer->cache;
+    std::unique_lock<std::mutex> guard(cache->lock);
+    while(true)
+    {
+	renderer->work_ready.wait(guard, [renderer] {
+		return renderer->quit || !renderer->visible_queue.empty() ||
+		    !renderer->refine_queue.empty() || !renderer->prefetch_queue.empty();
+	    });
+	if(renderer->quit)
+	{
+	    return;
+	}
+
+	if(!renderer->visible_queue.empty() || (!renderer->prefetch_queue.empty() && renderer->refine_queue.empty()))
+	{
+	    bool visible = !renderer->visible_queue.empty();
+	    std::deque<TileKey> &queue = visible ? renderer->visible_queue : renderer->prefetch_queue;
+	    TileKey key = queue.front();
+	    queue.pop_front();
+	    guard.unlock();
+
+	    // Visible tiles get a shallow pass first so the frame can show
+	    // them now, prefetch tiles go straight to the full depth
+	    int cap = key.max_iter;
+	    if(visible && cap > PREVIEW_ITER)
+	    {
+		cap = PREVIEW_ITER;
+	    }
+	    
+	    Tile *tile = tile_alloc_iterations();
+	    tile->iter_done = cap;
+	    tile->resumable = true;
+	    cpu_iterate(tile_region(key), cap, tile->iterations, &tile->unresolved);
+	    
+	    guard.lock();
+	    if(cap == key.max_iter && !renderer->keep_state)
+	    {
+		tile->unresolved.clear();
+		tile->unresolved.shrink_to_fit();
+	    }
+	    renderer->pending.erase(key);
+	    tile_cache_insert(cache, key, tile);
+	    if(cap < key.max_iter)
+	    {
+		renderer->refine_queue.push_back(key);
+		renderer->work_ready.notify_one();
+	    }
+	    renderer->tile_done.notify_all();
+	}
+	else
+	{
+	    TileKey key = renderer->refine_queue.front();
+	    renderer->refine_queue.pop_front();
+	    Tile *tile = tile_cache_find(cache, key);
+	    if(!tile || tile->refining || tile->iter_done >= key.max_iter)
+	    {
+		continue;
+	    }
+
+	    // Take the resume state out, the main thread may be reading the
+	    // tile's iterations while this runs. Trim leaves refining tiles be.
+	    std::vector<PixelState> unresolved;
+	    unresolved.swap(tile->unresolved);
+	    tile->refining = true;
+	    guard.unlock();
+
+	    std::vector<s32> iterations(TILE_SIZE*TILE_SIZE, -1);
+	    cpu_resume(tile_region(key), key.max_iter, iterations.data(), &unresolved);
+
+	    guard.lock();
+	    // A tile deepened from a finished one may share its contents
+	    tile_unshare(tile);
+	    for(int i = 0; i < TILE_SIZE*TILE_SIZE; ++i)
+	    {
+		if(iterations[i] >= 0)
+		{
+		    tile->iterations[i] = iterations[i];
+		}
+	    }
+	    tile->iter_done = key.max_iter;
+	    tile->refining = false;
+	    if(renderer->keep_state)
+	    {
+		tile->unresolved.swap(unresolved);
+	    }
+
+	    // A deeper request may have taken the tile over meanwhile
+	    TileKey current;
+	    if(tile_cache_key_of(cache, key, tile, &current) && current.max_iter > tile->iter_done)
+	    {
+		renderer->refine_queue.push_back(current);
+		renderer->work_ready.notify_one();
+	    }
+	    else
+	    {
+		tile_share(&cache->pool, tile);
+	    }
+	    
+	    renderer->refined = true;
+	    if(renderer->on_refined)
+	    {
+		renderer->on_refined();
+	    }
+	}
+    }
+}
+
+// Tiles a device took from one of the queues
+struct ClTileBatch
+{
+    bool visible;
+    std::vector<TileKey> keys;
+    std::vector<RenderRegion> regions;
+    std::vector<Tile*> tiles;
+    std::vector<s32*> outputs;
+    cl_event done;
+};
+
+// Visible tiles first, all with the max_iter of the first since that picks
+// the kernel variant
+static void take_cl_batch(TileRenderer *renderer, int limit, ClTileBatch *batch)
+{
+    batch->visible = !renderer->visible_queue.empty();
+    std::deque<TileKey> &queue = batch->visible ? renderer->visible_queue : renderer->prefetch_queue;
+    batch->keys.clear();
+    batch->keys.push_back(queue.front());
+    queue.pop_front();
+    while((int)batch->keys.size() < limit && !queue.empty() && queue.front().max_iter == batch->keys[0].max_iter)
+    {
+	batch->keys.push_back(queue.front());
+	queue.pop_front();
+    }
+}
+
+// Puts the tiles of a batch that didn't render back for any worker
+static void hand_back_cl_batch(TileRenderer *renderer, ClTileBatch *batch)
+{
+    for(Tile *tile : batch->tiles)
+    {
+	tile_free(tile);
+    }
+    batch->tiles.clear();
+    std::deque<TileKey> &queue = batch->visible ? renderer->visible_queue : renderer->prefetch_queue;
+    for(auto it = batch->keys.rbegin(); it != batch->keys.rend(); ++it)
+    {
+	queue.push_front(*it);
+    }
+    renderer->work_ready.notify_all();
+}
+
+static bool start_cl_batch(TileRenderer *renderer, int device, int set, ClTileBatch *batch, ClEngineState *state)
+{
+    batch->regions.clear();
+    batch->tiles.clear();
+    batch->outputs.clear();
+    for(const TileKey &key : batch->keys)
+    {
+	Tile *tile = tile_alloc_iterations();
+	tile->iter_done = key.max_iter;
+	batch->regions.push_back(tile_region(key));
+	batch->tiles.push_back(tile);
+	batch->outputs.push_back(tile->iterations);
+    }
+
+    KernelVariant variant = renderer->cl_variant;
+    variant.max_iter = batch->keys[0].max_iter;
+    std::lock_guard<std::mutex> cl_guard(renderer->cl_lock);
+    *state = cl_engine_select(renderer->cl_engine, variant);
+    if(*state != CL_ENGINE_READY)
+    {
+	return false;
+    }
+    if(!cl_engine_enqueue_batch(renderer->cl_engine, device, set, batch->regions.data(), (int)batch->keys.size(), batch->outputs.data(),
+				&batch->done))
+    {
+	*state = CL_ENGINE_FAILED;
+	return false;
+    }
+    return true;
+}
+
+static void cl_worker_main(TileRenderer *renderer, int device)
+{
+    TileCache *cache = renderer->cache;
+    ClEngine *engine = renderer->cl_engine;
+    int limit = cl_engine_batch_limit(engine, TILE_SIZE*TILE_SIZE);
+    if(limit > TILE_CL_BATCH)
+    {
+	limit = TILE_CL_BATCH;
+    }
+    if(limit < 1)
+    {
+	return;
+    }
+
+    // Batches alternate between the device's two iterations buffers, one
+    // can render while the other is read back
+    ClTileBatch batches[2];
+    ClTileBatch *in_flight = nullptr;
+    int set = 0;
+    
+    std::unique_lock<std::mutex> guard(cache->lock);
+    while(true)
+    {
+	if(!in_flight)
+	{
+	    renderer->cl_work_ready.wait(guard, [renderer] {
+		    return renderer->quit || renderer->cl_failed ||
+			!renderer->visible_queue.empty() || !renderer->prefetch_queue.empty();
+		});
+	}
+	bool stop = renderer->quit || renderer->cl_failed;
+	if(stop && !in_flight)
+	{
+	    return;
+	}
+
+	ClTileBatch *next = nullptr;
+	if(!stop && (!renderer->visible_queue.empty() || !renderer->prefetch_queue.empty()))
+	{
+	    next = &batches[set];
+	    take_cl_batch(renderer, limit, next);
+	}
+	guard.unlock();
+
+	// The next batch goes in before waiting on the last one's reads, so
+	// the device has work while the host waits on the transfer
+	ClEngineState state = CL_ENGINE_READY;
+	bool started = next && start_cl_batch(renderer, device, set, next, &state);
+	bool read = in_flight && cl_engine_finish_batch(engine, device, set ^ 1, in_flight->done);
+
+	guard.lock();
+	if(in_flight && read)
+	{
+	    for(size_t i = 0; i < in_flight->keys.size(); ++i)
+	    {
+		renderer->pending.erase(in_flight->keys[i]);
+		tile_cache_insert(cache, in_flight->keys[i], in_flight->tiles[i]);
+	    }
+	    in_flight->tiles.clear();
+	    renderer->tile_done.notify_all();
+	}
+	else if(in_flight)
+	{
+	    hand_back_cl_batch(renderer, in_flight);
+	    state = CL_ENGINE_FAILED;
+	}
+	in_flight = nullptr;
+	
+	if(started)
+	{
+	    in_flight = next;
+	    set ^= 1;
+	}
+	else if(next)
+	{
+	    hand_back_cl_batch(renderer, next);
+	}
+
+	// Wait out a new variant's build before taking more
+	if(state == CL_ENGINE_BUILDING)
+	{
+	    guard.unlock();
+	    {
+		std::lock_guard<std::mutex> cl_guard(renderer->cl_lock);
+		state = cl_engine_wait(engine);
+	    }
+	    guard.lock();
+	}
+	if(state != CL_ENGINE_BUILDING && state != CL_ENGINE_READY && !renderer->cl_failed)
+	{
+	    fprintf(stderr, "OpenCL failed, the CPU workers carry on alone\n");
+	    renderer->cl_failed = true;
+	    renderer->cl_work_ready.notify_all();
+	}
+    }
+}
+
+void tile_renderer_start(TileRenderer *renderer, TileCache *cache, int n_threads, void (*on_refined)())
+{
+    renderer->cache = cache;
+    renderer->quit = false;
+    renderer->precision = TILE_DOUBLE;
+    renderer->cl_engine = nullptr;
+    renderer->cl_failed = false;
+    renderer->refined = false;
+    renderer->on_refined = on_refined;
+    for(int i = 0; i < n_threads; ++i)
+    {
+	renderer->workers.emplace_back(worker_main, renderer);
+    }
+}
+
+void tile_renderer_stop(TileRenderer *renderer)
+{
+    {
+	std::lock_guard<std::mutex> guard(renderer->cache->lock);
+	renderer->quit = true;
+    }
+    renderer->work_ready.notify_all();
+    renderer->cl_work_ready.notify_all();
+    for(auto &worker : renderer->workers)
+    {
+	worker.join();
+    }
+    renderer->workers.clear();
+    for(auto &worker : renderer->cl_workers)
+    {
+	worker.join();
+    }
+    renderer->cl_workers.clear();
+    
+    renderer->visible_queue.clear();
+    renderer->refine_queue.clear();
+    renderer->prefetch_queue.clear();
+    renderer->pending.clear();
+}
+
+void tile_renderer_add_cl(TileRenderer *renderer, ClEngine *engine, const KernelVariant &variant)
+{
+    {
+	std::lock_guard<std::mutex> guard(renderer->cache->lock);
+	renderer->precision = TILE_CPU_CL_DOUBLE;
+	renderer->cl_engine = engine;
+	renderer->cl_variant = variant;
+    }
+    for(cl_uint i = 0; i < engine->n_devices; ++i)
+    {
+	renderer->cl_workers.emplace_back(cl_worker_main, renderer, (int)i);
+    }
+}
+
+void tile_renderer_request(TileRenderer *renderer, const TileKey &key, TilePriority priority)
+{
+    TileCache *cache = renderer->cache;
+    std::lock_guard<std::mutex> guard(cache->lock);
+    if(tile_cache_find(cache, key))
+    {
+	return;
+    }
+    TileKey old_key;
+    if(renderer->keep_state && !renderer->pending.count(key) && tile_cache_find_shallower(cache, key, &old_key))
+    {
+	// Re-key the shallower tile and resume its unresolved pixels
+	tile_cache_rekey(cache, old_key, key);
+	if(!tile_cache_find(cache, key)->refining)
+	{
+	    renderer->refine_queue.push_back(key);
+	    renderer->work_ready.notify_one();
+	}
+	renderer->tile_done.notify_all();
+	return;
+    }
+    if(renderer->pending.count(key))
+    {
+	if(priority == TILE_VISIBLE)
+	{
+	    // Promote it if it is still waiting in the prefetch queue
+	    for(auto it = renderer->prefetch_queue.begin(); it != renderer->prefetch_queue.end(); ++it)
+	    {
+		if(*it == key)
+		{
+		    renderer->prefetch_queue.erase(it);
+		    renderer->visible_queue.push_back(key);
+		    break;
+		}
+	    }
+	}
+	return;
+    }
+    
+    renderer->pending.insert(key);
+    if(priority == TILE_VISIBLE)
+    {
+	renderer->visible_queue.push_back(key);
+    }
+    else
+    {
+	renderer->prefetch_queue.push_back(key);
+    }
+    notify_new_tiles(renderer);
+}
+
+void tile_renderer_clear_prefetch(TileRenderer *renderer)
+{
+    std::lock_guard<std::mutex> guard(renderer->cache->lock);
+    for(const TileKey &key : renderer->prefetch_queue)
+    {
+	renderer->pending.erase(key);
+    }
+    renderer->prefetch_queue.clear();
+}
+
+bool tile_renderer_take_refined(TileRenderer *renderer)
+{
+    std::lock_guard<std::mutex> guard(renderer->cache->lock);
+    bool refined = renderer->refined;
+    renderer->refined = false;
+    return refined;
+}
+
+void tile_renderer_render(TileRenderer *renderer, const RenderRegion &region, int level, int max_iter, s32 *iterations)
+{
+    TileCache *cache = renderer->cache;
+    std::vector<TileKey> missing;
+    {
+	std::lock_guard<std::mutex> guard(cache->lock);
+	tile_cache_missing(cache, region, level, max_iter, renderer->precision, &missing);
+    }
+    for(const TileKey &key : missing)
+    {
+	tile_renderer_request(renderer, key, TILE_VISIBLE);
+    }
+
+    std::unique_lock<std::mutex> guard(cache->lock);
+    renderer->tile_done.wait(guard, [cache, &missing] {
+	    for(const TileKey &key : missing)
+	    {
+		if(!tile_cache_find(cache, key))
+		{
+		    return false;
+		}
+	    }
+	    return true;
+	});
+
+    // Compose under the lock so a refine pass can't write into a tile mid-copy
+    tile_cache_compose(cache, region, level, max_iter, renderer->precision, iterations);
+}
@@ -0,0 +1,85 @@
+#ifndef __TILE_RENDERER_H__
+#define __TILE_RENDERER_H__
+
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "tiles.h"
+#include "tile_cache.h"
+#include "cl_engine.h"
+
+// Most tiles an OpenCL device takes at once. Batches spread the cost of
+// launching and reading back, CPU workers take one tile at a time.
+#define TILE_CL_BATCH 16
+
+enum TilePriority
+{
+    TILE_VISIBLE,
+    TILE_PREFETCH
+};
+
+// CPU worker pool that renders TILE_DOUBLE tiles into a tile cache.
+// Visible tiles go first with a shallow preview pass, then the preview
+// tiles are deepened, and prefetch tiles only run on otherwise idle workers.
+// OpenCL devices can join in on the visible and prefetch tiles, taking
+// them in batches at full depth.
+//
+// The renderer's state is guarded by the cache's lock.
+struct TileRenderer
+{
+    TileCache *cache;
+    std::vector<std::thread> workers;
+    std::condition_variable work_ready;
+    std::condition_variable tile_done;
+    bool quit;
+    s32 precision;   // of the tiles it makes, TilePrecision
+
+    // One thread per device, woken apart from the CPU workers as they
+    // don't refine. cl_lock serializes selecting and enqueueing, and is
+    // never taken while holding the cache's lock.
+    ClEngine *cl_engine;
+    KernelVariant cl_variant;
+    std::vector<std::thread> cl_workers;
+    std::condition_variable cl_work_ready;
+    std::mutex cl_lock;
+    bool cl_failed;
+
+    std::deque<TileKey> visible_queue;
+    std::deque<TileKey> refine_queue;
+    std::deque<TileKey> prefetch_queue;
+    std::unordered_set<TileKey, TileKeyHash> pending;
+
+    // Keep the state of pixels still unresolved at max_iter, so raising
+    // max_iter later only runs the extra iterations. Set before starting.
+    bool keep_state = false;
+
+    // Set when a refine pass finished, called from the worker thread
+    bool refined;
+    void (*on_refined)();
+};
+
+void tile_renderer_start(TileRenderer *renderer, TileCache *cache, int n_threads, void (*on_refined)());
+void tile_renderer_stop(TileRenderer *renderer);
+// Lets every device of engine render tiles alongside the CPU workers. Only
+// for double variants, since both kinds of worker then fill the same
+// TILE_CPU_CL_DOUBLE tiles. Each batch uses variant with the batch's
+// max_iter. The engine must outlive the renderer.
+void tile_renderer_add_cl(TileRenderer *renderer, ClEngine *engine, const KernelVariant &variant);
+
+// A request for a deeper max_iter than a cached tile of the same position
+// has takes that tile over and resumes it, if its state was kept
+void tile_renderer_request(TileRenderer *renderer, const TileKey &key, TilePriority priority);
+// Forget queued prefetch work that a newer prediction replaces
+void tile_renderer_clear_prefetch(TileRenderer *renderer);
+// Returns whether any tile was deepened since the last call
+bool tile_renderer_take_refined(TileRenderer *renderer);
+
+// Renders the iterations of region from tiles at level, waiting for any
+// that are missing. Tiles still in their preview pass leave their
+// unresolved pixels at -1.
+void tile_renderer_render(TileRenderer *renderer, const RenderRegion &region, int level, int max_iter, s32 *iterations);
+
+#endif // __TILE_RENDERER_H__
@@ -0,0 +1,441 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <iterator>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tile_store.h"
+#include "tile_cache.h"
+#include "tile_codec.h"
+#include "defer.h"
+
+#define TILE_STORE_MAGIC 0x4d544c53   // "SLTM"
+#define TILE_STORE_VERSION 5
+#define TILE_STORE_RECORDS_PER_SLOT 4
+// A packed tile comes out no larger than raw values after the header
+#define TILE_STORE_SLOT_BYTES ((size_t)TILE_SIZE*TILE_SIZE*sizeof(u32) + sizeof(TilePackHeader))
+
+// Opens filename at exactly bytes long, new space reads as zeros
+static u8 *map_file(const char *path, const char *name, size_t bytes, int *fd_out)
+{
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s/%s", path, name);
+    
+    int fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if(fd < 0)
+    {
+	fprintf(stderr, "Unable to open tile store file '%s': %s\n", filename, std::strerror(errno));
+	return nullptr;
+    }
+    auto close_fd = deferred { close(fd); };
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || ((size_t)st.st_size != bytes && ftruncate(fd, bytes) != 0))
+    {
+	fprintf(stderr, "Unable to size tile store file '%s': %s\n", filename, std::strerror(errno));
+	return nullptr;
+    }
+    
+    void *mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(mapping == MAP_FAILED)
+    {
+	fprintf(stderr, "Unable to map tile store file '%s': %s\n", filename, std::strerror(errno));
+	return nullptr;
+    }
+
+    close_fd.deactivate();
+    *fd_out = fd;
+    return (u8*)mapping;
+}
+
+// Writes the pages under bytes from data of a mapping to disk
+static bool sync_range(const void *data, size_t bytes)
+{
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)data & ~(page - 1);
+    uintptr_t end = (uintptr_t)data + bytes;
+    if(msync((void*)start, end - start, MS_SYNC) != 0)
+    {
+	fprintf(stderr, "Unable to write tile store: %s\n", std::strerror(errno));
+	return false;
+    }
+    return true;
+}
+
+static TileKey record_key(const TileStoreRecord &record)
+{
+    TileKey key;
+    key.level = record.level;
+    key.max_iter = record.max_iter;
+    key.x = record.x;
+    key.y = record.y;
+    key.precision = record.precision;
+    return key;
+}
+
+// Drops a pin, handing the slot out again once no record uses it either
+static void unpin_slot(TileStore *store, u32 slot)
+{
+    store->pins[slot] -= 1;
+    if(store->pins[slot] == 0 && store->slot_refs[slot] == 0)
+    {
+	store->free_slots.push_back(slot);
+    }
+}
+
+// Drops the least recently used record that isn't mapped, freeing its slot
+// if nothing else uses it
+static bool evict_record(TileStore *store)
+{
+    // Only mapped records are stepped over, so this stops early
+    auto it = store->lru.end();
+    do
+    {
+	if(it == store->lru.begin())
+	{
+	    return false;
+	}
+	--it;
+    } while(store->pins[store->records[*it].slot] != 0);
+    u32 record_id = *it;
+    store->lru.erase(it);
+
+    // On disk before the slot can be written over
+    TileStoreRecord *record = &store->records[record_id];
+    store->index.erase(record_key(*record));
+    record->format = TILE_STORE_EMPTY;
+    sync_range(&record->format, sizeof(record->format));
+    store->free_records.push_back(record_id);
+    
+    u32 slot = record->slot;
+    store->slot_refs[slot] -= 1;
+    if(store->slot_refs[slot] == 0)
+    {
+	auto range = store->contents.equal_range(store->slot_hashes[slot]);
+	for(auto it = range.first; it != range.second; ++it)
+	{
+	    if(it->second == slot)
+	    {
+		store->contents.erase(it);
+		break;
+	    }
+	}
+	store->free_slots.push_back(slot);
+    }
+    return true;
+}
+
+static s64 free_slot(TileStore *store)
+{
+    if(store->free_slots.empty())
+    {
+	return -1;
+    }
+    u32 slot = store->free_slots.back();
+    store->free_slots.pop_back();
+    return slot;
+}
+
+static s64 free_record(TileStore *store)
+{
+    if(store->free_records.empty())
+    {
+	return -1;
+    }
+    u32 record_id = store->free_records.back();
+    store->free_records.pop_back();
+    return record_id;
+}
+
+static void writer_main(TileStore *store)
+{
+    std::unique_lock<std::mutex> guard(store->lock);
+    while(true)
+    {
+	store->work_ready.wait(guard, [store] { return store->quit || !store->write_queue.empty(); });
+	if(store->write_queue.empty())
+	{
+	    return;
+	}
+
+	TileKey key = store->write_queue.front().first;
+	Tile *tile = store->write_queue.front().second;
+	store->write_queue.pop_front();
+	defer {
+	    guard.unlock();
+	    tile_free(tile);
+	    guard.lock();
+	};
+	if(store->index.count(key))
+	{
+	    continue;
+	}
+
+	// Tiles shared in memory are packed already
+	u64 hash;
+	const u8 *packed;
+	size_t bytes;
+	u8 *packed_here = nullptr;
+	defer { free(packed_here); };
+	if(tile->payload)
+	{
+	    hash = tile->payload->hash;
+	    packed = tile->packed;
+	    bytes = tile->payload->bytes;
+	}
+	else
+	{
+	    hash = tile_content_hash(tile->iterations, TILE_SIZE*TILE_SIZE*sizeof(s32));
+	    packed_here = tile_pack(tile->iterations, TILE_SIZE*TILE_SIZE, &bytes);
+	    packed = packed_here;
+	}
+
+	// Reuse a slot with the same contents, or else write a new one.
+	// Packing is deterministic and the header gives the length, so equal
+	// leading bytes mean equal tiles.
+	s64 slot = -1;
+	auto range = store->contents.equal_range(hash);
+	for(auto it = range.first; it != range.second; ++it)
+	{
+	    if(memcmp(store->data + it->second * TILE_STORE_SLOT_BYTES, packed, bytes) == 0)
+	    {
+		slot = it->second;
+		break;
+	    }
+	}
+	bool new_slot = slot < 0;
+	if(new_slot)
+	{
+	    slot = free_slot(store);
+	    while(slot < 0 && evict_record(store))
+	    {
+		slot = free_slot(store);
+	    }
+	    if(slot < 0)
+	    {
+		continue;
+	    }
+	}
+
+	// The pin keeps the slot from being evicted for a record, or handed
+	// out again while it's written
+	store->pins[slot] += 1;
+	s64 record_id = free_record(store);
+	while(record_id < 0 && evict_record(store))
+	{
+	    record_id = free_record(store);
+	}
+	if(record_id < 0)
+	{
+	    unpin_slot(store, (u32)slot);
+	    continue;
+	}
+
+	// Empty records aren't looked at by anyone else, so the record fills
+	// in with the lock dropped. The contents and the rest of the record
+	// reach the disk before format says they're there.
+	TileStoreRecord *record = &store->records[record_id];
+	record->x = key.x;
+	record->y = key.y;
+	record->level = key.level;
+	record->max_iter = key.max_iter;
+	record->precision = key.precision;
+	record->slot = (u32)slot;
+	record->last_used = store->clock++;
+	record->unused = 0;
+	guard.unlock();
+	u8 *slot_data = store->data + slot * TILE_STORE_SLOT_BYTES;
+	bool synced = true;
+	if(new_slot)
+	{
+	    memcpy(slot_data, packed, bytes);
+	    store->slot_hashes[slot] = hash;
+	    synced = sync_range(slot_data, bytes) && sync_range(&store->slot_hashes[slot], sizeof(u64));
+	}
+	synced = synced && sync_range(record, sizeof(*record));
+	guard.lock();
+	if(!synced)
+	{
+	    store->free_records.push_back((u32)record_id);
+	    unpin_slot(store, (u32)slot);
+	    continue;
+	}
+
+	record->format = TILE_STORE_PACKED;
+	if(new_slot)
+	{
+	    store->contents.emplace(hash, (u32)slot);
+	}
+	store->slot_refs[slot] += 1;
+	unpin_slot(store, (u32)slot);
+	store->index[key] = (u32)record_id;
+	store->lru.push_front((u32)record_id);
+	store->lru_places[record_id] = store->lru.begin();
+    }
+}
+
+bool tile_store_open(TileStore *store, const char *path, size_t quota)
+{
+    u32 n_slots = (u32)(quota / TILE_STORE_SLOT_BYTES);
+    if(n_slots == 0)
+    {
+	fprintf(stderr, "Tile store quota of %zu bytes doesn't fit a single tile\n", quota);
+	return false;
+    }
+    if(mkdir(path, 0755) != 0 && errno != EEXIST)
+    {
+	fprintf(stderr, "Unable to create tile store '%s': %s\n", path, std::strerror(errno));
+	return false;
+    }
+
+    // Room for more tiles than slots, duplicates don't take a slot
+    u32 n_records = TILE_STORE_RECORDS_PER_SLOT * n_slots;
+    store->index_bytes = sizeof(TileStoreHeader) + (size_t)n_slots * sizeof(u64) +
+	(size_t)n_records * sizeof(TileStoreRecord);
+    store->data_bytes = (size_t)n_slots * TILE_STORE_SLOT_BYTES;
+    u8 *index = map_file(path, "index", store->index_bytes, &store->index_fd);
+    if(!index)
+    {
+	return false;
+    }
+    store->data = map_file(path, "tiles", store->data_bytes, &store->data_fd);
+    if(!store->data)
+    {
+	munmap(index, store->index_bytes);
+	close(store->index_fd);
+	return false;
+    }
+    
+    store->header = (TileStoreHeader*)index;
+    store->slot_hashes = (u64*)(index + sizeof(TileStoreHeader));
+    store->records = (TileStoreRecord*)(store->slot_hashes + n_slots);
+    if(store->header->magic != TILE_STORE_MAGIC || store->header->version != TILE_STORE_VERSION ||
+       store->header->tile_size != TILE_SIZE || store->header->n_slots != n_slots ||
+       store->header->n_records != n_records)
+    {
+	memset(index, 0, store->index_bytes);
+	store->header->magic = TILE_STORE_MAGIC;
+	store->header->version = TILE_STORE_VERSION;
+	store->header->tile_size = TILE_SIZE;
+	store->header->n_slots = n_slots;
+	store->header->n_records = n_records;
+    }
+
+    store->clock = 0;
+    store->index.clear();
+    store->contents.clear();
+    store->slot_refs.assign(n_slots, 0);
+    store->pins.assign(n_slots, 0);
+    store->free_slots.clear();
+    store->free_records.clear();
+    store->lru.clear();
+    store->lru_places.assign(n_records, store->lru.end());
+    std::vector<u32> filled;
+    for(u32 i = 0; i < n_records; ++i)
+    {
+	const TileStoreRecord &record = store->records[i];
+	if(record.format == TILE_STORE_EMPTY)
+	{
+	    store->free_records.push_back(i);
+	    continue;
+	}
+	filled.push_back(i);
+	store->index[record_key(record)] = i;
+	if(store->slot_refs[record.slot]++ == 0)
+	{
+	    store->contents.emplace(store->slot_hashes[record.slot], record.slot);
+	}
+	if(record.last_used >= store->clock)
+	{
+	    store->clock = record.last_used + 1;
+	}
+    }
+    // Handed out from the back, so the file fills from the front
+    std::reverse(store->free_records.begin(), store->free_records.end());
+    for(u32 i = n_slots; i-- > 0;)
+    {
+	if(store->slot_refs[i] == 0)
+	{
+	    store->free_slots.push_back(i);
+	}
+    }
+    // last_used only orders the records, the list is rebuilt from it
+    std::sort(filled.begin(), filled.end(), [store](u32 a, u32 b) {
+	    return store->records[a].last_used > store->records[b].last_used;
+	});
+    for(u32 i : filled)
+    {
+	store->lru.push_back(i);
+	store->lru_places[i] = std::prev(store->lru.end());
+    }
+
+    store->quit = false;
+    store->writer = std::thread(writer_main, store);
+    return true;
+}
+
+void tile_store_close(TileStore *store)
+{
+    {
+	std::lock_guard<std::mutex> guard(store->lock);
+	store->quit = true;
+    }
+    store->work_ready.notify_all();
+    store->writer.join();
+
+    munmap(store->data, store->data_bytes);
+    munmap(store->header, store->index_bytes);
+    close(store->data_fd);
+    close(store->index_fd);
+    store->index.clear();
+    store->contents.clear();
+    store->lru.clear();
+}
+
+Tile *tile_store_load(TileStore *store, const TileKey &key)
+{
+    std::lock_guard<std::mutex> guard(store->lock);
+    auto it = store->index.find(key);
+    if(it == store->index.end())
+    {
+	return nullptr;
+    }
+    
+    TileStoreRecord *record = &store->records[it->second];
+    u32 slot = record->slot;
+    record->last_used = store->clock++;
+    store->lru.splice(store->lru.begin(), store->lru, store->lru_places[it->second]);
+    store->pins[slot] += 1;
+
+    Tile *tile = new Tile;
+    tile->iterations = nullptr;
+    tile->iter_done = key.max_iter;
+    tile->refining = false;
+    tile->resumable = false;
+    tile->payload = nullptr;
+    tile->packed = store->data + slot * TILE_STORE_SLOT_BYTES;
+    tile->store = store;
+    tile->slot = slot;
+    return tile;
+}
+
+void tile_store_unpin(TileStore *store, u32 slot)
+{
+    std::lock_guard<std::mutex> guard(store->lock);
+    unpin_slot(store, slot);
+}
+
+void tile_store_write(TileStore *store, const TileKey &key, Tile *tile)
+{
+    {
+	std::lock_guard<std::mutex> guard(store->lock);
+	store->write_queue.emplace_back(key, tile);
+    }
+    store->work_ready.notify_one();
+}
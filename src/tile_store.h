@@ -0,0 +1,95 @@
+#ifndef __TILE_STORE_H__
+#define __TILE_STORE_H__
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "typedefs.h"
+#include "tiles.h"
+
+#define TILE_STORE_DEFAULT_QUOTA ((size_t)1 << 30)
+
+struct Tile;
+
+enum TileStoreFormat
+{
+    TILE_STORE_EMPTY,
+    TILE_STORE_PACKED     // see tile_codec.h
+};
+
+struct TileStoreHeader
+{
+    u32 magic;
+    u32 version;
+    u32 tile_size;
+    u32 n_slots;
+    u32 n_records;
+    u32 unused;
+};
+
+// A stored tile. Tiles with the same contents share one slot. The fields
+// are the key's one by one, so no padding reaches the file.
+struct TileStoreRecord
+{
+    s64 x, y;
+    s32 level;
+    s32 max_iter;
+    s32 precision;
+    u32 slot;
+    u64 last_used;
+    u32 format;       // TileStoreFormat, written once the rest is on disk
+    u32 unused;
+};
+
+// Finished tiles kept on disk across sessions, packed in a file of fixed
+// size slots next to an index of which tile is in which slot. Slots are
+// addressed by content, so uniform tiles take one slot however many there
+// are. Both files are mapped: opening only scans the index, and stored
+// tiles are read in place, only the pages of their packed bytes.
+struct TileStore
+{
+    int index_fd, data_fd;
+    TileStoreHeader *header;
+    u64 *slot_hashes;               // content hash of each slot in use
+    TileStoreRecord *records;
+    u8 *data;
+    size_t index_bytes, data_bytes;
+
+    std::mutex lock;
+    std::unordered_map<TileKey, u32, TileKeyHash> index;   // to records
+    std::unordered_multimap<u64, u32> contents;            // hash to slots
+    std::vector<u32> slot_refs;     // records using each slot
+    std::vector<u32> pins;          // per slot, mapped tiles and writes in flight
+    std::vector<u32> free_slots;    // no records and no pins
+    std::vector<u32> free_records;  // TILE_STORE_EMPTY
+    std::list<u32> lru;             // filled records, most recently used first
+    std::vector<std::list<u32>::iterator> lru_places;   // per record, in lru
+    u64 clock;
+
+    // Tiles waiting for the writer, which owns and frees them
+    std::thread writer;
+    std::condition_variable work_ready;
+    std::deque<std::pair<TileKey, Tile*>> write_queue;
+    bool quit;
+};
+
+// Opens or creates the store in directory path, with room for as many
+// tiles as fit in quota bytes. Starts over if the quota or format changed.
+bool tile_store_open(TileStore *store, const char *path, size_t quota);
+// Finishes queued writes first
+void tile_store_close(TileStore *store);
+
+// The tile under key, mapped in place and pinned until tile_free
+Tile *tile_store_load(TileStore *store, const TileKey &key);
+void tile_store_unpin(TileStore *store, u32 slot);
+// Takes ownership of a finished tile and writes it out in the background,
+// evicting the least recently used slots once the quota is full
+void tile_store_write(TileStore *store, const TileKey &key, Tile *tile);
+
+#endif // __TILE_STORE_H__
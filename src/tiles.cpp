@@ -0,0 +1,93 @@
+#include <cmath>
+
+#include "tiles.h"
+#include "hash.h"
+
+size_t TileKeyHash::operator()(const TileKey &key) const
+{
+    // Field by field, so padding never gets hashed
+    const s64 parts[] = {key.level, key.max_iter, key.x, key.y, key.precision};
+    return (size_t)hash_bytes(HASH_SEED, parts, sizeof(parts));
+}
+
+double tile_step(int level)
+{
+    return std::ldexp(4.0 / TILE_SIZE, -level);
+}
+
+int tile_level_for_step(double step)
+{
+    return (int)std::ceil(std::log2((4.0 / TILE_SIZE) / step));
+}
+
+RenderRegion tile_region(const TileKey &key)
+{
+    RenderRegion region;
+    region.step = tile_step(key.level);
+    region.origin_x = (key.x * TILE_SIZE + 0.5) * region.step;
+    region.origin_y = (key.y * TILE_SIZE + 0.5) * region.step;
+    region.width = TILE_SIZE;
+    region.height = TILE_SIZE;
+    return region;
+}
+
+TileKey tile_canonical(const TileKey &key)
+{
+    TileKey canonical = key;
+    if(key.y < 0)
+    {
+	canonical.y = -key.y - 1;
+    }
+    return canonical;
+}
+
+void tile_range(const RenderRegion &region, int level, s64 *x0, s64 *y0, s64 *x1, s64 *y1)
+{
+    double span = TILE_SIZE * tile_step(level);
+    *x0 = (s64)std::floor(region.origin_x / span);
+    *y0 = (s64)std::floor(region.origin_y / span);
+    *x1 = (s64)std::floor((region.origin_x + (region.width-1) * region.step) / span);
+    *y1 = (s64)std::floor((region.origin_y + (region.height-1) * region.step) / span);
+}
+
+void tile_blit(const TileKey &key, const s32 *iterations, const RenderRegion &region, s32 *out)
+{
+    double step = tile_step(key.level);
+    double tile_x = key.x * TILE_SIZE * step;
+    double tile_y = key.y * TILE_SIZE * step;
+    double tile_end_x = tile_x + TILE_SIZE * step;
+    double tile_end_y = tile_y + TILE_SIZE * step;
+
+    // Output pixels whose sample point falls inside the tile
+    int px0 = (int)std::ceil((tile_x - region.origin_x) / region.step);
+    int py0 = (int)std::ceil((tile_y - region.origin_y) / region.step);
+    int px1 = (int)std::ceil((tile_end_x - region.origin_x) / region.step);
+    int py1 = (int)std::ceil((tile_end_y - region.origin_y) / region.step);
+    if(px0 < 0) px0 = 0;
+    if(py0 < 0) py0 = 0;
+    if(px1 > region.width) px1 = region.width;
+    if(py1 > region.height) py1 = region.height;
+
+    for(int py = py0; py < py1; ++py)
+    {
+	double c_y = region.origin_y + py * region.step;
+	int ty = (int)((c_y - tile_y) / step);
+	if(ty < 0) ty = 0;
+	if(ty >= TILE_SIZE) ty = TILE_SIZE-1;
+	if(key.y < 0)
+	{
+	    ty = TILE_SIZE-1 - ty;
+	}
+	
+	const s32 *src = iterations + (size_t)ty * TILE_SIZE;
+	s32 *dst = out + (size_t)py * region.width;
+	for(int px = px0; px < px1; ++px)
+	{
+	    double c_x = region.origin_x + px * region.step;
+	    int tx = (int)((c_x - tile_x) / step);
+	    if(tx < 0) tx = 0;
+	    if(tx >= TILE_SIZE) tx = TILE_SIZE-1;
+	    dst[px] = src[tx];
+	}
+    }
+}
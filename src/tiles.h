@@ -0,0 +1,59 @@
+#ifndef __TILES_H__
+#define __TILES_H__
+
+#include <cstddef>
+
+#include "typedefs.h"
+#include "cpu_render.h"
+
+#define TILE_SIZE 256
+
+// Tiles form a quadtree over the complex plane. A level 0 tile spans 4
+// units, each level halves the pixel step, and tile (x,y) has its lower
+// left corner at (x,y) * TILE_SIZE * step. Pixels are sampled at their
+// centers, so tile (x,y) is the exact mirror image of tile (x,-y-1).
+struct TileKey
+{
+    s32 level;
+    s32 max_iter;
+    s64 x, y;
+    s32 precision;   // TilePrecision
+};
+
+// Which engine filled a tile. They round differently, so their tiles
+// never stand in for each other.
+enum TilePrecision
+{
+    TILE_DOUBLE,       // CPU renderer
+    TILE_CL_FLOAT,     // test.cl
+    TILE_GLSL_FLOAT,   // simple.frag
+    TILE_CL_DOUBLE,    // test.cl with USE_DOUBLE
+    TILE_CPU_CL_DOUBLE // either of those two, when they share the work
+};
+
+inline bool operator==(const TileKey &a, const TileKey &b)
+{
+    return a.level == b.level && a.max_iter == b.max_iter && a.x == b.x && a.y == b.y &&
+	a.precision == b.precision;
+}
+
+struct TileKeyHash
+{
+    size_t operator()(const TileKey &key) const;
+};
+
+double tile_step(int level);
+// The coarsest level whose pixels are no larger than step
+int tile_level_for_step(double step);
+RenderRegion tile_region(const TileKey &key);
+// Tiles below the real axis are stored as their mirror image above it
+TileKey tile_canonical(const TileKey &key);
+
+// Range of tiles at level covering region, inclusive
+void tile_range(const RenderRegion &region, int level, s64 *x0, s64 *y0, s64 *x1, s64 *y1);
+
+// Copies the overlap of tile key with region into out, nearest neighbour,
+// from the iterations of tile_canonical(key)
+void tile_blit(const TileKey &key, const s32 *iterations, const RenderRegion &region, s32 *out);
+
+#endif // __TILES_H__